@@ -1,11 +1,24 @@
+#include <SPI.h>
+#include <Wire.h>
+#include <EEPROM.h>
 #include "uart.h"
+#include "messages.h"
 #include "button.h"
 #include "pins.h"
+#include "memstats.h"
+#include "sampler.h"
+#include "rules.h"
 
 #define BAUDRATE 115200
 
+// Boot counter, right after the rule tables
+#define BOOT_EEPROM   (RULES_EEPROM + RULES_EEPROM_LEN)
+
 static UartComms UART_comms;
-static uint8_t DO_mask;
+static DOMask DO_mask;
+// Tells the host a restart apart from a reconnection, micros() alone
+// cannot once the board has been up longer than before
+static uint16_t boot_id;
 
 void setup()
 {
@@ -14,126 +27,565 @@ void setup()
 	while (!Serial);
 	UART_comms.begin(Serial);
 
-	// Init GPIOs
+	// Init outputs, all relays off
+	Board::Relays::begin();
+	Board::Relays::write(DO_mask.raw());
+	#if EXTERNAL_LED
+		Board::Leds::begin();
+		Board::Leds::write(DO_mask.raw());
+	#endif
+
 	for (uint8_t i = 0; i < MAX_DI; i++) {
-		pinMode(DO_relays[i], OUTPUT);
-		#if EXTERNAL_LED
-			pinMode(LEDs_state[i], OUTPUT);
-		#endif
-		DO_mask = 0;
+		Sample_Input(i, DI_buttons[i].getPin());
 	}
-}
 
-#define MSG_GETSTATS  1
-#define MSG_SETDO     2
-#define MSG_TEST      3
+	Rules_Begin(MAX_DO, MAX_DI);
 
-#define HEADER_MSG    2
+	EEPROM.get(BOOT_EEPROM, boot_id);
+	boot_id++;
+	EEPROM.put(BOOT_EEPROM, boot_id);
+}
 
-struct st_msg_do_val {
-	uint8_t do_num;
-	uint8_t do_val;
-};
+#define BULK_LEN      256
 
-struct st_msg_stats {
-	uint8_t do_mask;
-};
+// Largest answer of a request is its own length
+#define REPLY_ECHO    0xFF
 
+static_assert(DATA_LEN == HEADER_MSG + MSG_MAX_PAYLOAD, "frame and message sizes differ");
+static_assert(msg_stats::size + DOMask::bytes <= MSG_MAX_PAYLOAD, "relay mask does not fit a frame");
+static_assert(SAMPLE_MAX_INPUTS <= SAMPLE_BITS, "sampled inputs do not fit a nibble");
+static_assert(MAX_DI <= SAMPLE_MAX_INPUTS, "too many inputs to sample");
 
-struct st_msg {
+// Reassembly of large payloads
+static uint8_t bulk_buf[BULK_LEN];
+static struct {
+	uint8_t xfer;
 	uint8_t type;
-	uint8_t length;
-	uint8_t payload[DATA_LEN-2];
+	uint16_t total;
+	uint16_t next;
+} bulk_rx;
+static uint8_t bulk_tx_xfer;
+// Payload of bulk_buf being sent back
+static struct {
+	uint8_t type;
+	uint16_t total;
+	uint16_t offset;
+	bool active;
+} bulk_tx;
+
+// Streams sent from loop() when the line is idle, samples first
+#define STREAM_SAMPLES  0
+#define STREAM_BULK     1
+#define STREAMS         2
+// Frames of a stream that found the line busy and how long one waited
+static struct {
+	uint16_t deferred;
+	uint32_t wait_max;
+	uint32_t ready_since;
+	bool waiting;
+	bool held;
+} streams[STREAMS];
+
+// State a handler may need besides its request
+struct msg_context {
+	DOMask *do_mask;    // relay state to apply at the end of the loop pass
+	uint32_t rx_time;   // micros() when the frame was checked
 };
 
-static void SendDOStats(void)
+// Handlers read a request and build their answer in reply, which is the
+// request itself for a single message. They return false when there is
+// nothing to answer.
+typedef bool (*msg_handler)(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx);
+
+// Stats answer, also used to acknowledge MSG_SETDO with the resulting mask
+static bool ReplyDOStats(struct st_msg *reply, uint8_t type, const DOMask *do_mask)
+{
+	struct msg_stats stats;
+	stats.timestamp = micros();
+	stats.boot = boot_id;
+	stats.rules = Rules_Count();
+	stats.channels = MAX_DO;
+	stats.do_mask.data = do_mask->raw();
+	stats.do_mask.length = DOMask::bytes;
+
+	reply->type = type;
+	reply->length = stats.encode(&reply->payload[0]);
+
+	return true;
+}
+
+static bool ReplyGetStats(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
 {
-	struct st_msg *msg = (struct st_msg *)(&UART_comms.outgoingArray[0]);
-	msg->type = MSG_GETSTATS;
-	msg->length = sizeof(struct st_msg_stats);
+	return ReplyDOStats(reply, MSG_GETSTATS, ctx->do_mask);
+}
 
-	struct st_msg_stats *payload = (struct st_msg_stats *)(&msg->payload[0]);
-	payload->do_mask = DO_mask;
+static bool ReplyTimeSync(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
+{
+	struct msg_timesync sync;
+	if (!sync.decode(&msg->payload[0], msg->length)) {
+		return false;
+	}
+
+	// t1 is echoed untouched
+	sync.t2 = ctx->rx_time;
+	sync.t3 = micros();
+	reply->type = MSG_TIMESYNC;
+	reply->length = sync.encode(&reply->payload[0]);
+
+	return true;
+}
+
+static void SendEvent(uint8_t di_num, uint8_t edge, uint32_t timestamp)
+{
+	struct st_msg *msg = (struct st_msg *)(&UART_comms.frameArray[0]);
+	struct msg_event event;
+	event.di_num = di_num;
+	event.edge = edge;
+	event.timestamp = timestamp;
+
+	msg->type = MSG_EVENT;
+	msg->length = event.encode(&msg->payload[0]);
 
 	UART_comms.sendData(msg->length + HEADER_MSG);
 }
 
-static uint8_t Get_UART_DO(struct st_msg *msg, uint8_t new_do_mask)
+static bool Get_UART_DO(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
 {
-	struct st_msg_do_val *payload = (struct st_msg_do_val *)(&msg->payload[0]);
+	struct msg_do_val request;
+	if (!request.decode(&msg->payload[0], msg->length)) {
+		return false;
+	}
 
-	if (payload->do_val) {
-		new_do_mask |= (1 << payload->do_num);
-	} else {
-		new_do_mask &= ~(1 << payload->do_num);
+	// Unknown relays are ignored, the answer shows the mask unchanged
+	if (request.do_num < MAX_DO) {
+		ctx->do_mask->set(request.do_num, request.do_val);
 	}
+	// The answer shows what the interlocks let through
+	Rules_Apply(DO_mask.raw(), ctx->do_mask->raw());
 
-	return new_do_mask;
+	return ReplyDOStats(reply, MSG_SETDO, ctx->do_mask);
 }
 
-static void SendTestMsg(struct st_msg *msg)
+static bool ReplyTestMsg(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
 {
-	memcpy(&UART_comms.outgoingArray[0], msg, msg->length + HEADER_MSG);
+	// Echo the request as is
+	if (reply != msg) {
+		memcpy(reply, msg, msg->length + HEADER_MSG);
+	}
+	return true;
+}
+
+static bool ReplyTrace(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
+{
+	struct msg_trace stages;
+	stages.rx_first = UART_comms.rxStartTime;
+	stages.rx_checked = ctx->rx_time;
+	stages.dispatched = micros();
+
+	reply->type = MSG_TRACE;
+	reply->length = stages.encode(&reply->payload[0]);
+
+	return true;
+}
+
+static bool ReplyMemStats(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
+{
+	struct msg_memstats mem;
+	mem.free_ram = Mem_Free();
+	mem.stack_max = Mem_StackMax();
+	mem.static_ram = Mem_Static();
+	mem.samples_deferred = streams[STREAM_SAMPLES].deferred;
+	mem.samples_wait = streams[STREAM_SAMPLES].wait_max;
+	mem.bulk_deferred = streams[STREAM_BULK].deferred;
+	mem.bulk_wait = streams[STREAM_BULK].wait_max;
+
+	reply->type = MSG_MEMSTATS;
+	reply->length = mem.encode(&reply->payload[0]);
+
+	return true;
+}
+
+static bool Get_UART_SampleCtl(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
+{
+	struct msg_sample_ctl ctl;
+	if (!ctl.decode(&msg->payload[0], msg->length)) {
+		return false;
+	}
+
+	// Answer with what was actually programmed
+	ctl.rate = Sample_Start(ctl.rate);
+	ctl.inputs = MAX_DI;
+	ctl.batch = SAMPLE_BATCH;
+	reply->type = MSG_SAMPLE_CTL;
+	reply->length = ctl.encode(&reply->payload[0]);
+
+	return true;
+}
+
+static bool Get_UART_Rules(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
+{
+	struct msg_rules request;
+	if (!request.decode(&msg->payload[0], msg->length)) {
+		return false;
+	}
+
+	// Stored before the answer is built over the request
+	struct msg_rules_ack ack;
+	ack.status = Rules_Store(request.first, request.count, request.data.data, request.data.length, &ack.next);
+	if ((ack.status == RULES_OK) && Rules_Committing()) {
+		// The last request is answered by SendRulesAck() once in EEPROM
+		return false;
+	}
+	reply->type = MSG_RULES_SET;
+	reply->length = ack.encode(&reply->payload[0]);
+
+	return true;
+}
+
+static void SendRulesAck(void)
+{
+	struct st_msg *msg = (struct st_msg *)(&UART_comms.frameArray[0]);
+	struct msg_rules_ack ack;
+	ack.next = Rules_Count();
+	ack.status = RULES_OK;
+
+	msg->type = MSG_RULES_SET;
+	msg->length = ack.encode(&msg->payload[0]);
+
 	UART_comms.sendData(msg->length + HEADER_MSG);
 }
 
-static uint8_t Get_UART_Data(uint8_t new_do_mask)
+static bool ReplyRules(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
+{
+	struct msg_rules_get request;
+	if (!request.decode(&msg->payload[0], msg->length)) {
+		return false;
+	}
+
+	uint8_t records[RULES_PER_GET * msg_rule_stat::size];
+	struct msg_rules rules;
+	rules.first = request.first;
+	rules.count = Rules_Count();
+	rules.data.data = records;
+	rules.data.length = 0;
+
+	struct msg_rule_stat stat;
+	for (uint8_t n = request.first; (rules.data.length < sizeof(records)) && Rules_Get(n, &stat); n++) {
+		rules.data.length += stat.encode(&records[rules.data.length]);
+	}
+
+	reply->type = MSG_RULES_GET;
+	reply->length = rules.encode(&reply->payload[0]);
+
+	return true;
+}
+
+static void SendSamples(const struct sample_batch *batch)
+{
+	struct st_msg *msg = (struct st_msg *)(&UART_comms.frameArray[0]);
+	struct msg_samples samples;
+	samples.seq = batch->seq;
+	samples.timestamp = batch->timestamp;
+	samples.data.data = batch->data;
+
+	msg->type = MSG_SAMPLES;
+	msg->length = samples.encode(&msg->payload[0]);
+	Sample_Release(batch);
+
+	// Packed, a batch takes 44 bytes on the wire instead of 84
+	UART_comms.sendData(msg->length + HEADER_MSG, true);
+}
+
+static bool ReplyBulkAck(struct st_msg *reply, uint8_t xfer, uint8_t status, uint16_t next)
+{
+	struct msg_bulk_ack ack;
+	ack.xfer = xfer;
+	ack.status = status;
+	ack.next = next;
+
+	reply->type = MSG_BULK_ACK;
+	reply->length = ack.encode(&reply->payload[0]);
+
+	return true;
+}
+
+static void SendBulk(uint8_t type, uint16_t total)
+{
+	// Fragments go out from loop() as background traffic
+	bulk_tx_xfer++;
+	bulk_tx.type = type;
+	bulk_tx.total = total;
+	bulk_tx.offset = 0;
+	bulk_tx.active = true;
+}
+
+static void SendBulkFragment(void)
+{
+	struct st_msg *msg = (struct st_msg *)(&UART_comms.frameArray[0]);
+	uint16_t offset = bulk_tx.offset;
+	uint8_t len = (bulk_tx.total - offset > BULK_FRAG) ? BULK_FRAG : (bulk_tx.total - offset);
+
+	struct msg_bulk frag;
+	frag.xfer = bulk_tx_xfer;
+	frag.type = bulk_tx.type;
+	frag.total = bulk_tx.total;
+	frag.offset = offset;
+	frag.data.data = &bulk_buf[offset];
+	frag.data.length = len;
+
+	msg->type = MSG_BULK;
+	msg->length = frag.encode(&msg->payload[0]);
+
+	UART_comms.sendData(msg->length + HEADER_MSG);
+
+	bulk_tx.offset += len;
+	bulk_tx.active = (bulk_tx.offset < bulk_tx.total);
+}
+
+static bool Get_UART_Bulk(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
+{
+	// The acknowledgement may overwrite the fragment, so it is consumed first
+	struct msg_bulk frag;
+	if (!frag.decode(&msg->payload[0], msg->length)) {
+		return false;
+	}
+	uint8_t len = frag.data.length;
+
+	// First fragment starts a new transfer
+	if (frag.offset == 0) {
+		if (frag.total > BULK_LEN) {
+			bulk_rx.total = 0;
+			return ReplyBulkAck(reply, frag.xfer, BULK_TOOBIG, 0);
+		}
+		// The buffer is reused, whatever was being sent from it is dropped
+		bulk_tx.active = false;
+		bulk_rx.xfer = frag.xfer;
+		bulk_rx.type = frag.type;
+		bulk_rx.total = frag.total;
+		bulk_rx.next = 0;
+	}
+
+	// Lost fragment, ask the host to go back
+	if ((frag.xfer != bulk_rx.xfer) || (frag.offset > bulk_rx.next) ||
+	    (frag.offset + len > bulk_rx.total)) {
+		return ReplyBulkAck(reply, frag.xfer, BULK_RETRY, (frag.xfer == bulk_rx.xfer) ? bulk_rx.next : 0);
+	}
+
+	// Duplicates are only acknowledged
+	if (frag.offset == bulk_rx.next) {
+		memcpy(&bulk_buf[bulk_rx.next], frag.data.data, len);
+		bulk_rx.next += len;
+
+		if (bulk_rx.next == bulk_rx.total) {
+			switch (bulk_rx.type) {
+				case MSG_TEST:
+					SendBulk(MSG_TEST, bulk_rx.total);
+					break;
+				default:
+					break;
+			}
+		}
+	}
+
+	return ReplyBulkAck(reply, bulk_rx.xfer, BULK_OK, bulk_rx.next);
+}
+
+// Count a stream frame held back this pass, or its wait if it goes out
+static void TrackStream(uint8_t stream, bool ready, bool sent, uint32_t now)
+{
+	if (!ready) {
+		streams[stream].waiting = false;
+		return;
+	}
+	if (!streams[stream].waiting) {
+		streams[stream].waiting = true;
+		streams[stream].held = false;
+		streams[stream].ready_since = now;
+	}
+
+	if (sent) {
+		uint32_t wait = now - streams[stream].ready_since;
+		if (wait > streams[stream].wait_max) {
+			streams[stream].wait_max = wait;
+		}
+		streams[stream].waiting = false;
+	} else if (!streams[stream].held) {
+		streams[stream].held = true;
+		streams[stream].deferred++;
+	}
+}
+
+static void SendBackground(void)
+{
+	// Answers and events are written as soon as they are ready. Streams go
+	// one frame per loop pass and only onto an idle line. A frame already
+	// on the wire cannot yield, so an answer waits for at most that frame.
+	const struct sample_batch *batch = Sample_Next();
+	uint8_t send = STREAMS;
+	if (UART_comms.txIdle()) {
+		// Sample batches are dropped if not sent in time, bulk data can wait
+		if (batch != NULL) {
+			send = STREAM_SAMPLES;
+		} else if (bulk_tx.active) {
+			send = STREAM_BULK;
+		}
+	}
+
+	uint32_t now = micros();
+	TrackStream(STREAM_SAMPLES, batch != NULL, send == STREAM_SAMPLES, now);
+	TrackStream(STREAM_BULK, bulk_tx.active, send == STREAM_BULK, now);
+
+	if (send == STREAM_SAMPLES) {
+		SendSamples(batch);
+	} else if (send == STREAM_BULK) {
+		SendBulkFragment();
+	}
+}
+
+struct msg_route {
+	uint8_t type;
+	msg_handler handler;   // NULL for messages the device does not accept
+	uint8_t reply_len;     // largest answer, REPLY_ECHO for the request length
+};
+
+// Requests by message type, kept in flash
+static constexpr struct msg_route routes[MSG_TYPES] PROGMEM = {
+	{ 0,              NULL,               0 },
+	{ MSG_GETSTATS,   ReplyGetStats,      msg_stats::size + DOMask::bytes },
+	{ MSG_SETDO,      Get_UART_DO,        msg_stats::size + DOMask::bytes },
+	{ MSG_TEST,       ReplyTestMsg,       REPLY_ECHO },
+	{ MSG_TIMESYNC,   ReplyTimeSync,      msg_timesync::size },
+	{ MSG_EVENT,      NULL,               0 },
+	{ MSG_BULK,       Get_UART_Bulk,      msg_bulk_ack::size },
+	{ MSG_BULK_ACK,   NULL,               0 },
+	{ MSG_MEMSTATS,   ReplyMemStats,      msg_memstats::size },
+	{ MSG_SAMPLE_CTL, Get_UART_SampleCtl, msg_sample_ctl::size },
+	{ MSG_SAMPLES,    NULL,               0 },
+	{ MSG_CONTAINER,  NULL,               0 },  // unpacked by Get_UART_Container
+	{ MSG_TRACE,      ReplyTrace,         msg_trace::size },
+	{ MSG_RULES_SET,  Get_UART_Rules,     msg_rules_ack::size },
+	{ MSG_RULES_GET,  ReplyRules,         msg_rules::size + RULES_PER_GET * msg_rule_stat::size },
+};
+
+static constexpr bool RoutesInOrder(uint8_t i)
+{
+	return (i == MSG_TYPES) || ((routes[i].type == i) && RoutesInOrder(i + 1));
+}
+static_assert(RoutesInOrder(0), "routes must be indexed by message type");
+
+// Largest answer a request can produce
+static uint8_t ReplyLength(const struct st_msg *msg)
+{
+	if (msg->type >= MSG_TYPES) {
+		return 0;
+	}
+	uint8_t len = pgm_read_byte(&routes[msg->type].reply_len);
+	return (len == REPLY_ECHO) ? msg->length : len;
+}
+
+static bool Get_UART_Msg(struct st_msg *msg, struct st_msg *reply, struct msg_context *ctx)
+{
+	if (msg->type >= MSG_TYPES) {
+		return false;
+	}
+	msg_handler handler = (msg_handler)pgm_read_ptr(&routes[msg->type].handler);
+	return (handler != NULL) && handler(msg, reply, ctx);
+}
+
+static void Get_UART_Container(struct st_msg *msg, struct msg_context *ctx)
+{
+	// Answers are collected in the frame buffer, so the requests move out first
+	uint8_t requests[MSG_MAX_PAYLOAD];
+	uint8_t length = msg->length;
+	if (length > sizeof(requests)) {
+		return;
+	}
+	memcpy(requests, &msg->payload[0], length);
+
+	msg->length = 0;
+	uint8_t pos = 0;
+	while (pos + HEADER_MSG <= length) {
+		struct st_msg *sub = (struct st_msg *)(&requests[pos]);
+		if (pos + HEADER_MSG + sub->length > length) {
+			break;
+		}
+		pos += HEADER_MSG + sub->length;
+
+		// Send what is collected when the next answer might not fit
+		if (msg->length + HEADER_MSG + ReplyLength(sub) > MSG_MAX_PAYLOAD) {
+			UART_comms.sendData(msg->length + HEADER_MSG, true);
+			msg->length = 0;
+		}
+
+		struct st_msg *reply = (struct st_msg *)(&msg->payload[msg->length]);
+		if (Get_UART_Msg(sub, reply, ctx)) {
+			msg->length += HEADER_MSG + reply->length;
+		}
+	}
+
+	if (msg->length > 0) {
+		UART_comms.sendData(msg->length + HEADER_MSG, true);
+	}
+}
+
+static DOMask Get_UART_Data(DOMask new_do_mask)
 {
 	// Get statistics or new DI value
 	int8_t report = UART_comms.getData();
 
 	//figure out if data was available - if so, determine if the transfer successful
 	if (report == 1) {
-		struct st_msg msg;
-		memcpy(&msg, &UART_comms.incomingArray[0], sizeof(struct st_msg));
-
-		switch (msg.type) {
-			case MSG_GETSTATS:
-				SendDOStats();
-				break;
-			case MSG_SETDO:
-				return Get_UART_DO(&msg, new_do_mask);
-				break;
-			case MSG_TEST:
-				SendTestMsg(&msg);
-				break;
-			default:
-				break;
+		struct msg_context ctx;
+		ctx.do_mask = &new_do_mask;
+		ctx.rx_time = micros();
+		// Handlers work on the frame buffer and build their answer in it
+		struct st_msg *msg = (struct st_msg *)(&UART_comms.frameArray[0]);
+
+		if (msg->type == MSG_CONTAINER) {
+			Get_UART_Container(msg, &ctx);
+		} else if (Get_UART_Msg(msg, msg, &ctx)) {
+			UART_comms.sendData(msg->length + HEADER_MSG);
 		}
 	}
 	return new_do_mask;
 }
 
-static uint8_t Get_Buttons(uint8_t new_do_mask)
+static DOMask Get_Buttons(DOMask new_do_mask)
 {
-	// Change state DI according to the rising edge of the buttons
 	for (uint8_t i = 0; i < MAX_DI; i++) {
-		if (DI_buttons[i].getState() == Button::Rising) {
-			if ((new_do_mask & (1 << i)) > 0) {
-				new_do_mask &= ~(1 << i);
-			} else {
-				new_do_mask |= (1 << i);
-			}
+		Button::State state = DI_buttons[i].getState();
+		if ((state != Button::Rising) && (state != Button::Falling)) {
+			continue;
 		}
+		// Without rules of its own, the rising edge toggles the relay of the same number
+		if (!Rules_Input(i, state, new_do_mask.raw()) && (state == Button::Rising) && (i < MAX_DO)) {
+			new_do_mask.toggle(i);
+		}
+		// Report debounced edges with the time of the raw transition
+		SendEvent(i, state, DI_buttons[i].getEdgeTime());
 	}
 
 	return new_do_mask;
 }
 
 void loop() {
-	uint8_t new_do_val = DO_mask;
+	DOMask new_do_val;
 
 	new_do_val = Get_UART_Data(DO_mask);
 	new_do_val = Get_Buttons(new_do_val);
+	// Timers and interlocks, whether or not the host is there
+	Rules_Apply(DO_mask.raw(), new_do_val.raw());
+	if (Rules_Poll()) {
+		SendRulesAck();
+	}
+	SendBackground();
 
-	// Update DO
-	for (uint8_t i = 0; i < MAX_DI; i++) {
-		bool status = (new_do_val & (1 << i)) > 0;
-		digitalWrite(DO_relays[i], !status);
+	// Update DO, the whole bank in one burst and only when it changed
+	if (new_do_val != DO_mask) {
+		Board::Relays::write(new_do_val.raw());
 		#if EXTERNAL_LED
-			digitalWrite(LEDs_state[i], !status);
+			Board::Leds::write(new_do_val.raw());
 		#endif
+		DO_mask = new_do_val;
 	}
-
-	DO_mask = new_do_val;
 }
@@ -99,6 +99,9 @@
 # BOARD        Specify a target board type.  Run `make boards` to see available
 #              board types.
 #
+# RELAY_BOARD  Board descriptor from pins.h to build for instead of the one
+#              matching BOARD, e.g. ShiftBoard<8>.
+#
 # LIBRARIES    A list of arduino libraries to build and include.  This is set
 #              automatically if a .ino (or .pde) is found.
 #
@@ -142,6 +145,7 @@ ifndef ARDUINODIR
 ARDUINODIR := $(wildcard ~/opt/arduino)
 endif
 BOARDS_FILE := $(ARDUINODIR)/hardware/arduino/avr/boards.txt
+ARDUINOPLATLIBSDIR := $(ARDUINODIR)/hardware/arduino/avr/libraries
 ifeq "$(wildcard $(BOARDS_FILE))" ""
 $(error ARDUINODIR is not set correctly; arduino software not found)
 endif
@@ -173,8 +177,10 @@ SOURCES := $(INOFILE) \
 	$(wildcard $(addprefix $(SRC_PATH)/util/, *.c *.cc *.cpp)) \
 	$(wildcard $(addprefix $(SRC_PATH)/utility/, *.c *.cc *.cpp))
 
-# automatically determine included libraries
-ARDUINOLIBSAVAIL := $(notdir $(wildcard $(ARDUINODIR)/libraries/*))
+# automatically determine included libraries, bundled with the software or
+# with the avr platform (SPI, Wire, EEPROM)
+ARDUINOLIBSAVAIL := $(notdir $(wildcard $(ARDUINODIR)/libraries/* \
+	$(ARDUINOPLATLIBSDIR)/*))
 LIBRARIES += $(filter $(ARDUINOLIBSAVAIL), \
 	$(shell sed -ne "s/^ *\# *include *[<\"]\(.*\)\.h[>\"]/\1/p" $(SOURCES)))
 
@@ -213,7 +219,9 @@ ARDUINOLIBOBJS := $(patsubst %, $(ARDUINOLIBTMP)/%.o, $(basename $(notdir \
 ARDUINOLIBOBJS += $(foreach lib, $(LIBRARIES), \
 	$(patsubst %, $(ARDUINOLIBTMP)/%.o, $(basename $(notdir \
 	$(wildcard $(addprefix $(ARDUINOLIBSDIR)/$(lib)/, *.c *.cpp)) \
-	$(wildcard $(addprefix $(ARDUINOLIBSDIR)/$(lib)/utility/, *.c *.cpp)) ))))
+	$(wildcard $(addprefix $(ARDUINOLIBSDIR)/$(lib)/utility/, *.c *.cpp)) \
+	$(wildcard $(addprefix $(ARDUINOPLATLIBSDIR)/$(lib)/src/, *.c *.cpp)) \
+	$(wildcard $(addprefix $(ARDUINOPLATLIBSDIR)/$(lib)/src/utility/, *.c *.cpp)) ))))
 ARDUINOLIBOBJS += $(foreach lib, $(LOCAL_LIBS), \
 	$(patsubst %, $(ARDUINOLIBTMP)/%.o, $(basename $(notdir \
 	$(wildcard $(addprefix $(SKETCHES)/libraries/$(lib)/, *.c *.cpp)) ))))
@@ -284,10 +292,11 @@ CPPFLAGS := -Os -Wall -fno-exceptions -ffunction-sections -fdata-sections
 CPPFLAGS += -funsigned-char -funsigned-bitfields -fpack-struct -fshort-enums
 CPPFLAGS += -mmcu=$(BOARD_BUILD_MCU)
 CPPFLAGS += -DF_CPU=$(BOARD_BUILD_FCPU) -DARDUINO=$(ARDUINOCONST)
-CPPFLAGS += -I. -Iutil -Iutility -I$(ARDUINOSRCDIR)
+CPPFLAGS += -I. -Iutil -Iutility -Icommon -I$(ARDUINOSRCDIR)
 CPPFLAGS += -I$(ARDUINODIR)/hardware/arduino/avr/variants/$(BOARD_BUILD_VARIANT)/
 CPPFLAGS += $(addprefix -I$(ARDUINODIR)/libraries/, $(LIBRARIES))
 CPPFLAGS += $(patsubst %, -I$(ARDUINODIR)/libraries/%/utility, $(LIBRARIES))
+CPPFLAGS += $(patsubst %, -I$(ARDUINOPLATLIBSDIR)/%/src, $(LIBRARIES))
 CPPFLAGS += $(addprefix -I$(SKETCHES)/libraries/, $(LOCAL_LIBS))
 AVRDUDEFLAGS := $(addprefix -C , $(AVRDUDECONF)) -DV
 AVRDUDEFLAGS += -p $(BOARD_BUILD_MCU) -P $(SERIALDEV)
@@ -298,6 +307,9 @@ LINKFLAGS := -Os -Wl,--gc-sections -mmcu=$(BOARD_BUILD_MCU)
 BOARD_HIGH := $(shell echo '$(BOARD)' | tr '[:lower:]' '[:upper:]')
 DEFINES := -DARDUINO_AVR_$(BOARD_HIGH)
 DEFINES += -DARDUINO_ARCH_AVR
+ifneq "$(RELAY_BOARD)" ""
+DEFINES += -DRELAY_BOARD='$(RELAY_BOARD)'
+endif
 CPPFLAGS += $(DEFINES)
 
 # figure out which arg to use with stty
@@ -411,3 +423,15 @@ $(ARDUINOLIBTMP)/%.o: $(ARDUINODIR)/libraries/*/utility/%.c
 $(ARDUINOLIBTMP)/%.o: $(ARDUINODIR)/libraries/*/utility/%.cpp
 	@test -d $(ARDUINOLIBTMP) || mkdir $(ARDUINOLIBTMP)
 	$(COMPILE.cpp) -o $@ $<
+
+$(ARDUINOLIBTMP)/%.o: $(ARDUINOPLATLIBSDIR)/*/src/%.c
+	@test -d $(ARDUINOLIBTMP) || mkdir $(ARDUINOLIBTMP)
+	$(COMPILE.c) -o $@ $<
+
+$(ARDUINOLIBTMP)/%.o: $(ARDUINOPLATLIBSDIR)/*/src/%.cpp
+	@test -d $(ARDUINOLIBTMP) || mkdir $(ARDUINOLIBTMP)
+	$(COMPILE.cpp) -o $@ $<
+
+$(ARDUINOLIBTMP)/%.o: $(ARDUINOPLATLIBSDIR)/*/src/utility/%.c
+	@test -d $(ARDUINOLIBTMP) || mkdir $(ARDUINOLIBTMP)
+	$(COMPILE.c) -o $@ $<
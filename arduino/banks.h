@@ -0,0 +1,119 @@
+#pragma once
+
+#include <Arduino.h>
+#include <SPI.h>
+#include <Wire.h>
+
+// Output banks take the channel bits of the whole bank at once, 1 switches a
+// relay on. The relay modules are active low.
+
+/**
+ * @brief   Compile-time list of digital pins.
+ */
+template <uint8_t... Pins>
+struct PinList {
+	static const uint8_t count = sizeof...(Pins);
+
+	static uint8_t pin(uint8_t i) {
+		static const uint8_t pins[] = { Pins... };
+		return pins[i];
+	}
+};
+
+/**
+ * @brief   Relays wired straight to GPIO pins, one digitalWrite() each.
+ */
+template <uint8_t... Pins>
+struct DirectBank {
+	static const uint8_t count = sizeof...(Pins);
+
+	static void begin() {
+		for (uint8_t i = 0; i < count; i++) {
+			pinMode(PinList<Pins...>::pin(i), OUTPUT);
+		}
+	}
+
+	static void write(const uint8_t *bits) {
+		for (uint8_t i = 0; i < count; i++) {
+			digitalWrite(PinList<Pins...>::pin(i), !((bits[i >> 3] >> (i & 7)) & 1));
+		}
+	}
+};
+
+/**
+ * @brief   Bank of a board without the outputs, writes are dropped.
+ */
+struct NoBank {
+	static const uint8_t count = 0;
+
+	static void begin() {
+	}
+
+	static void write(const uint8_t *) {
+	}
+};
+
+/**
+ * @brief   Chained 74HC595 shift registers on the hardware SPI pins.
+ *
+ * The whole chain is clocked out in one SPI burst, last chip first, and the
+ * outputs change together when LatchPin rises.
+ */
+template <uint8_t Chips, uint8_t LatchPin>
+struct ShiftBank {
+	static const uint8_t count = Chips * 8;
+
+	static void begin() {
+		pinMode(LatchPin, OUTPUT);
+		SPI.begin();
+	}
+
+	static void write(const uint8_t *bits) {
+		SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE0));
+		digitalWrite(LatchPin, LOW);
+		for (uint8_t i = Chips; i > 0; i--) {
+			SPI.transfer(~bits[i - 1]);
+		}
+		digitalWrite(LatchPin, HIGH);
+		SPI.endTransaction();
+	}
+};
+
+/**
+ * @brief   MCP23017 I2C expanders at consecutive addresses from Address.
+ *
+ * Both 8-bit ports of a chip are written in one I2C transaction, relying on
+ * the register address auto-increment (IOCON.BANK = 0, the reset default).
+ */
+template <uint8_t Address, uint8_t Chips>
+struct Mcp23017Bank {
+	static const uint8_t count = Chips * 16;
+
+	static void begin() {
+		static const uint8_t off[2] = { 0xFF, 0xFF };
+		static const uint8_t outputs[2] = { 0x00, 0x00 };
+
+		Wire.begin();
+		Wire.setClock(400000);
+		for (uint8_t chip = 0; chip < Chips; chip++) {
+			// Latch the relays off before the pins become outputs
+			transfer(chip, 0x12, off);  // GPIOA, GPIOB
+			transfer(chip, 0x00, outputs);  // IODIRA, IODIRB
+		}
+	}
+
+	static void write(const uint8_t *bits) {
+		for (uint8_t chip = 0; chip < Chips; chip++) {
+			uint8_t ports[2] = { (uint8_t)~bits[chip * 2], (uint8_t)~bits[chip * 2 + 1] };
+			transfer(chip, 0x12, ports);
+		}
+	}
+
+	private:
+		static void transfer(uint8_t chip, uint8_t reg, const uint8_t *ports) {
+			Wire.beginTransmission(Address + chip);
+			Wire.write(reg);
+			Wire.write(ports, 2);
+			Wire.endTransmission();
+		}
+};
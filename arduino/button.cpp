@@ -19,8 +19,19 @@ Button::State Button::getState() {
 		rstate = static_cast<State>((debouncedState << 1) | debouncedState);
 	}
 	if (state != prevState) { // Button is pressed, released or bounces
+		if (prevState == debouncedState) { // first transition away from the stable state
+			edgeTime = micros();
+		}
 		prevBounceTime = millis();
 		prevState = state;
 	}
 	return rstate;
+}
+
+unsigned long Button::getEdgeTime() const {
+	return edgeTime;
+}
+
+pin_t Button::getPin() const {
+	return pin;
 }
\ No newline at end of file
@@ -48,12 +48,27 @@ class Button {
 	 */
 	State getState(); // Check if the button state changed
 
+	/**
+	 * @brief   Get the time of the last raw edge.
+	 *
+	 * @return  micros() value captured when the raw input first left its
+	 *          debounced state, i.e. the start of the bounce window that
+	 *          produced the last Falling or Rising state.
+	 */
+	unsigned long getEdgeTime() const;
+
+	/**
+	 * @brief   Get the digital pin the button is read from.
+	 */
+	pin_t getPin() const;
+
 	private:
 		const pin_t pin;
 
 		bool prevState = HIGH;
 		bool debouncedState = HIGH;
 		unsigned long prevBounceTime = 0;
+		unsigned long edgeTime = 0;
 
 		constexpr static unsigned long debounceTime = 100; // 100 milliseconds
 };
\ No newline at end of file
@@ -0,0 +1,55 @@
+#include "memstats.h"
+
+#define STACK_CANARY 0xC5
+
+extern uint8_t __data_start;
+extern uint8_t __heap_start;
+extern uint8_t *__brkval;
+
+// Runs inline from .init1, before r1 is cleared and the stack is set up,
+// so it is written in assembly and only uses call-clobbered registers.
+void Mem_Paint(void) __attribute__ ((naked, used, section (".init1")));
+
+void Mem_Paint(void)
+{
+	__asm volatile (
+		"    ldi r30, lo8(__heap_start)\n"
+		"    ldi r31, hi8(__heap_start)\n"
+		"    ldi r24, %0\n"
+		"    ldi r25, hi8(__stack)\n"
+		"    rjmp 2f\n"
+		"1:  st Z+, r24\n"
+		"2:  cpi r30, lo8(__stack)\n"
+		"    cpc r31, r25\n"
+		"    brlo 1b\n"
+		"    breq 1b\n"
+		:: "M" (STACK_CANARY)
+	);
+}
+
+static uint8_t *Heap_Top(void)
+{
+	return (__brkval == 0) ? &__heap_start : __brkval;
+}
+
+uint16_t Mem_Free(void)
+{
+	return (uint8_t *)SP - Heap_Top();
+}
+
+uint16_t Mem_StackMax(void)
+{
+	uint8_t *p = Heap_Top();
+
+	// The canary below the current stack pointer is untouched
+	while ((p <= (uint8_t *)SP) && (*p == STACK_CANARY)) {
+		p++;
+	}
+
+	return (uint8_t *)RAMEND - p + 1;
+}
+
+uint16_t Mem_Static(void)
+{
+	return &__heap_start - &__data_start;
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <Arduino.h>
+
+/**
+ * @brief   Free RAM between the top of the heap and the stack pointer.
+ */
+uint16_t Mem_Free(void);
+
+/**
+ * @brief   Deepest stack usage since reset, in bytes.
+ *
+ * The free RAM is painted with a canary pattern before any constructor runs.
+ * The high-water mark is where the stack has overwritten the pattern.
+ */
+uint16_t Mem_StackMax(void);
+
+/**
+ * @brief   RAM taken by static data (.data and .bss), in bytes.
+ */
+uint16_t Mem_Static(void);
@@ -1,30 +1,67 @@
-#define MAX_DI 4
-
-static const uint8_t DO_relays[MAX_DI] = {
-	#ifdef ARDUINO_AVR_NANO
-		2, 3, 4, 5
-	#elif ARDUINO_AVR_PRO
-		6, 7, 8, 9
-	#else
-		#error Usopported board selection
-	#endif
+#pragma once
+
+#include "banks.h"
+#include "bitmask.h"
+#include "button.h"
+
+// Board descriptors: Relays is an output bank, Buttons the list of input
+// pins, Leds an optional bank mirroring the first relays (EXTERNAL_LED),
+// NoBank on boards without one.
+
+struct NanoBoard {
+	typedef DirectBank<2, 3, 4, 5> Relays;
+	typedef PinList<10, 11, 12, 9> Buttons;
+	typedef DirectBank<6, 7, 8, 8> Leds;
+};
+
+struct ProBoard {
+	typedef DirectBank<6, 7, 8, 9> Relays;
+	typedef PinList<2, 3, 4, 5> Buttons;
+	typedef DirectBank<6, 7, 8, 8> Leds;
+};
+
+// 74HC595 relay modules on MOSI (11) and SCK (13), latched by pin 10
+template <uint8_t Chips>
+struct ShiftBoard {
+	typedef ShiftBank<Chips, 10> Relays;
+	typedef PinList<2, 3, 4, 5> Buttons;
+	typedef NoBank Leds;
 };
 
-static Button DI_buttons[MAX_DI] = {
-	#ifdef ARDUINO_AVR_NANO
-		10, 11, 12, 9
-	#elif ARDUINO_AVR_PRO
-		2, 3, 4, 5
-	#else
-		#error Unsupported board selection
-	#endif
+// MCP23017 relay modules on SDA (A4) and SCL (A5), addresses from 0x20
+template <uint8_t Chips>
+struct Mcp23017Board {
+	typedef Mcp23017Bank<0x20, Chips> Relays;
+	typedef PinList<2, 3, 4, 5> Buttons;
+	typedef NoBank Leds;
 };
 
-#if EXTERNAL_LED
-	static const uint8_t LEDs_state[MAX_DI] = {
-		6,
-		7,
-		8,
-		8
-	};
+// RELAY_BOARD overrides the board picked from the toolchain, e.g.
+// RELAY_BOARD=ShiftBoard<8> in .config for a rack of 64 relays
+#if defined(RELAY_BOARD)
+	typedef RELAY_BOARD Board;
+#elif defined(ARDUINO_AVR_NANO)
+	typedef NanoBoard Board;
+#elif defined(ARDUINO_AVR_PRO)
+	typedef ProBoard Board;
+#else
+	#error Unsupported board selection
 #endif
+
+#define MAX_DO Board::Relays::count
+#define MAX_DI Board::Buttons::count
+
+static_assert(MAX_DO <= MAX_CHANNELS, "too many relays for the protocol");
+
+typedef BitMask<MAX_DO> DOMask;
+
+template <class List>
+struct ButtonBank;
+
+template <uint8_t... Pins>
+struct ButtonBank<PinList<Pins...> > {
+	Button buttons[sizeof...(Pins)] = { Button(Pins)... };
+};
+
+static ButtonBank<Board::Buttons> DI_bank;
+static Button *const DI_buttons = DI_bank.buttons;
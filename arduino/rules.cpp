@@ -0,0 +1,355 @@
+#include <EEPROM.h>
+#include "rules.h"
+
+// Two table slots: a new table is written to the one not in use and takes
+// over with a single byte write, so a refused or interrupted load leaves
+// the previous table in place
+
+static_assert(RULES_MAX <= 16, "running timers are kept in 16 bits");
+
+static struct msg_rule rules[RULES_MAX];
+static uint16_t hits[RULES_MAX];
+static uint32_t started[RULES_MAX];
+static uint16_t running;
+static uint8_t n_rules;
+static uint8_t n_relays;
+static uint8_t n_inputs;
+// Relays of timers dropped with the table they belonged to
+static uint8_t expired[RULES_MAX];
+static uint8_t n_expired;
+
+// Table being stored, staged in RAM until its last rule arrives and then
+// written to EEPROM one byte per Rules_Poll() so loop() never stalls
+static uint8_t staged[RULES_MAX * msg_rule::size];
+static bool storing;
+static bool committing;
+static uint8_t store_next;
+static uint8_t store_count;
+static uint8_t store_sum;
+static uint8_t commit_pos;
+
+static bool MaskGet(const uint8_t *mask, uint8_t n)
+{
+	return (mask[n >> 3] >> (n & 7)) & 1;
+}
+
+static void MaskSet(uint8_t *mask, uint8_t n, bool value)
+{
+	if (value) {
+		mask[n >> 3] |= (1 << (n & 7));
+	} else {
+		mask[n >> 3] &= ~(1 << (n & 7));
+	}
+}
+
+static uint16_t SlotAddress(uint8_t slot)
+{
+	return RULES_EEPROM + 1 + slot * RULES_SLOT;
+}
+
+static uint8_t ActiveSlot(void)
+{
+	return EEPROM.read(RULES_EEPROM) & 1;
+}
+
+static uint8_t ChecksumAdd(uint8_t sum, uint8_t value)
+{
+	return ((sum << 1) | (sum >> 7)) ^ value;
+}
+
+static bool Rule_Valid(const struct msg_rule *rule)
+{
+	switch (rule->kind) {
+		case RULE_EDGE:
+			return (rule->input < n_inputs) && (rule->relay < n_relays) &&
+			       (rule->edge & (EDGE_RISING | EDGE_FALLING)) && (rule->arg <= RULE_TOGGLE);
+		case RULE_PULSE:
+		case RULE_ONESHOT:
+			return (rule->input < n_inputs) && (rule->relay < n_relays) &&
+			       (rule->edge & (EDGE_RISING | EDGE_FALLING)) && (rule->arg > 0);
+		case RULE_MUTEX:
+			return rule->relay < n_relays;
+		case RULE_FORCE_OFF:
+			return (rule->input < n_relays) && (rule->relay < n_relays) && (rule->input != rule->relay);
+		default:
+			return false;
+	}
+}
+
+static void Rules_Load(void)
+{
+	uint16_t addr = SlotAddress(ActiveSlot());
+	uint8_t count = EEPROM.read(addr + 1);
+
+	n_rules = 0;
+	running = 0;
+	memset(hits, 0, sizeof(hits));
+
+	if ((EEPROM.read(addr) != RULES_MAGIC) || (count > RULES_MAX)) {
+		return;
+	}
+
+	uint8_t sum = count;
+	for (uint8_t i = 0; i < count; i++) {
+		uint8_t buf[msg_rule::size];
+		for (uint8_t b = 0; b < sizeof(buf); b++) {
+			buf[b] = EEPROM.read(addr + RULES_HEADER + i * msg_rule::size + b);
+			sum = ChecksumAdd(sum, buf[b]);
+		}
+		rules[i].decode(buf, sizeof(buf));
+		if (!Rule_Valid(&rules[i])) {
+			return;
+		}
+	}
+	if (EEPROM.read(addr + 2) != sum) {
+		return;
+	}
+	n_rules = count;
+}
+
+void Rules_Begin(uint8_t relays, uint8_t inputs)
+{
+	n_relays = relays;
+	n_inputs = inputs;
+	Rules_Load();
+}
+
+bool Rules_Input(uint8_t input, uint8_t edge, uint8_t *mask)
+{
+	bool watched = false;
+	uint32_t now = millis();
+
+	for (uint8_t i = 0; i < n_rules; i++) {
+		const struct msg_rule *rule = &rules[i];
+		if (((rule->kind != RULE_EDGE) && (rule->kind != RULE_PULSE) && (rule->kind != RULE_ONESHOT)) ||
+		    (rule->input != input)) {
+			continue;
+		}
+		watched = true;
+		if (!(rule->edge & edge)) {
+			continue;
+		}
+
+		if (rule->kind == RULE_EDGE) {
+			bool value = (rule->arg == RULE_TOGGLE) ? !MaskGet(mask, rule->relay) : (rule->arg == RULE_ON);
+			MaskSet(mask, rule->relay, value);
+		} else {
+			if ((rule->kind == RULE_ONESHOT) && ((running >> i) & 1)) {
+				continue;
+			}
+			MaskSet(mask, rule->relay, true);
+			started[i] = now;
+			running |= (1 << i);
+		}
+		hits[i]++;
+	}
+
+	return watched;
+}
+
+void Rules_Apply(const uint8_t *prev, uint8_t *mask)
+{
+	uint32_t now = millis();
+
+	// Timers the table in use no longer has
+	while (n_expired > 0) {
+		MaskSet(mask, expired[--n_expired], false);
+	}
+
+	// Pulses that ran out
+	for (uint8_t i = 0; i < n_rules; i++) {
+		if (((running >> i) & 1) && (now - started[i] >= rules[i].arg)) {
+			MaskSet(mask, rules[i].relay, false);
+			running &= ~(1 << i);
+		}
+	}
+
+	// Each mutex group is handled at its first rule
+	for (uint8_t i = 0; i < n_rules; i++) {
+		if (rules[i].kind != RULE_MUTEX) {
+			continue;
+		}
+		bool first = true;
+		for (uint8_t j = 0; (j < i) && first; j++) {
+			first = (rules[j].kind != RULE_MUTEX) || (rules[j].input != rules[i].input);
+		}
+		if (!first) {
+			continue;
+		}
+
+		// Keep the first relay just switched on, or else the first one on
+		int8_t keep = -1;
+		for (uint8_t j = i; j < n_rules; j++) {
+			uint8_t relay = rules[j].relay;
+			if ((rules[j].kind != RULE_MUTEX) || (rules[j].input != rules[i].input) || !MaskGet(mask, relay)) {
+				continue;
+			}
+			if ((keep < 0) || (!MaskGet(prev, relay) && MaskGet(prev, rules[keep].relay))) {
+				keep = j;
+			}
+		}
+		if (keep < 0) {
+			continue;
+		}
+		for (uint8_t j = i; j < n_rules; j++) {
+			uint8_t relay = rules[j].relay;
+			if ((rules[j].kind != RULE_MUTEX) || (rules[j].input != rules[i].input) ||
+			    (relay == rules[keep].relay) || !MaskGet(mask, relay)) {
+				continue;
+			}
+			MaskSet(mask, relay, false);
+			hits[j]++;
+		}
+	}
+
+	// Interlocks only switch relays off, repeated until chains of them settle
+	bool changed = true;
+	while (changed) {
+		changed = false;
+		for (uint8_t i = 0; i < n_rules; i++) {
+			const struct msg_rule *rule = &rules[i];
+			if ((rule->kind == RULE_FORCE_OFF) && !MaskGet(mask, rule->input) && MaskGet(mask, rule->relay)) {
+				MaskSet(mask, rule->relay, false);
+				hits[i]++;
+				changed = true;
+			}
+		}
+	}
+}
+
+uint8_t Rules_Store(uint8_t first, uint8_t count, const uint8_t *data, uint8_t length, uint8_t *next)
+{
+	if (first == 0) {
+		// A table still being written is dropped, the one in use stays
+		committing = false;
+		storing = true;
+		store_next = 0;
+		store_count = count;
+	}
+	if (!storing || committing || (first != store_next) || (count != store_count)) {
+		*next = store_next;
+		return RULES_ORDER;
+	}
+	if (count > RULES_MAX) {
+		storing = false;
+		*next = RULES_MAX;
+		return RULES_INVALID;
+	}
+
+	for (uint8_t pos = 0; (store_next < count) && (pos + msg_rule::size <= length); pos += msg_rule::size) {
+		struct msg_rule rule;
+		rule.decode(&data[pos], msg_rule::size);
+		if (!Rule_Valid(&rule)) {
+			storing = false;
+			*next = store_next;
+			return RULES_INVALID;
+		}
+		memcpy(&staged[store_next * msg_rule::size], &data[pos], msg_rule::size);
+		store_next++;
+	}
+	*next = store_next;
+
+	if (store_next == count) {
+		store_sum = count;
+		for (uint8_t i = 0; i < count * msg_rule::size; i++) {
+			store_sum = ChecksumAdd(store_sum, staged[i]);
+		}
+		commit_pos = 0;
+		committing = true;
+	}
+
+	return RULES_OK;
+}
+
+static void Rules_Reload(void)
+{
+	struct {
+		uint8_t kind;
+		uint8_t relay;
+		uint32_t started;
+	} timers[RULES_MAX];
+	uint8_t n_timers = 0;
+
+	for (uint8_t i = 0; i < n_rules; i++) {
+		if ((running >> i) & 1) {
+			timers[n_timers].kind = rules[i].kind;
+			timers[n_timers].relay = rules[i].relay;
+			timers[n_timers].started = started[i];
+			n_timers++;
+		}
+	}
+
+	Rules_Load();
+
+	// A running pulse goes on under a rule of the same kind on the same
+	// relay, or else its relay is switched off: a new table never leaves
+	// a relay on that no timer will switch off
+	for (uint8_t t = 0; t < n_timers; t++) {
+		uint8_t j = 0;
+		while ((j < n_rules) && ((rules[j].kind != timers[t].kind) || (rules[j].relay != timers[t].relay) ||
+		       ((running >> j) & 1))) {
+			j++;
+		}
+		if (j < n_rules) {
+			started[j] = timers[t].started;
+			running |= (1 << j);
+		} else if (n_expired < RULES_MAX) {
+			expired[n_expired++] = timers[t].relay;
+		}
+	}
+}
+
+bool Rules_Committing(void)
+{
+	return committing;
+}
+
+bool Rules_Poll(void)
+{
+	if (!committing) {
+		return false;
+	}
+
+	// Rules first, then the header, then the switch to the new slot
+	uint8_t slot = ActiveSlot() ^ 1;
+	uint16_t addr = SlotAddress(slot);
+	uint8_t length = store_count * msg_rule::size;
+	if (commit_pos < length) {
+		EEPROM.update(addr + RULES_HEADER + commit_pos, staged[commit_pos]);
+	} else if (commit_pos == length) {
+		EEPROM.update(addr + 1, store_count);
+	} else if (commit_pos == length + 1) {
+		EEPROM.update(addr + 2, store_sum);
+	} else if (commit_pos == length + 2) {
+		EEPROM.update(addr, RULES_MAGIC);
+	} else {
+		EEPROM.update(RULES_EEPROM, slot);
+		committing = false;
+		storing = false;
+		Rules_Reload();
+		return true;
+	}
+	commit_pos++;
+
+	return false;
+}
+
+uint8_t Rules_Count(void)
+{
+	return n_rules;
+}
+
+bool Rules_Get(uint8_t n, struct msg_rule_stat *stat)
+{
+	if (n >= n_rules) {
+		return false;
+	}
+
+	stat->kind = rules[n].kind;
+	stat->input = rules[n].input;
+	stat->edge = rules[n].edge;
+	stat->relay = rules[n].relay;
+	stat->arg = rules[n].arg;
+	stat->hits = hits[n];
+	return true;
+}
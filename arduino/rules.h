@@ -0,0 +1,85 @@
+#pragma once
+
+#include <Arduino.h>
+#include "messages.h"
+
+// Table header in EEPROM, followed by the rules in wire layout
+#define RULES_EEPROM       0
+#define RULES_MAGIC        0x52
+#define RULES_HEADER       3
+// Two table slots, see rules.cpp
+#define RULES_SLOT         (RULES_HEADER + RULES_MAX * msg_rule::size)
+#define RULES_EEPROM_LEN   (1 + 2 * RULES_SLOT)
+
+/**
+ * @brief   Load the rule table stored in EEPROM.
+ *
+ * A table that is damaged, or refers to relays or inputs the board does not
+ * have, is dropped and the device runs without rules.
+ */
+void Rules_Begin(uint8_t relays, uint8_t inputs);
+
+/**
+ * @brief   Apply the rules watching an input to a debounced edge.
+ *
+ * @param   edge
+ *          EDGE_RISING or EDGE_FALLING.
+ * @param   mask
+ *          Relay mask to update, channel n in bit n % 8 of byte n / 8.
+ * @return  true if any rule watches the input, which then no longer
+ *          toggles its relay by itself.
+ */
+bool Rules_Input(uint8_t input, uint8_t edge, uint8_t *mask);
+
+/**
+ * @brief   Enforce timers, mutual exclusion and interlocks on a new mask.
+ *
+ * Pulses that ran out are switched off first, then every mutex group keeps
+ * one relay on, preferring one that was just switched on, then relays
+ * forced off by another are switched off. The result always satisfies the
+ * interlocks, whatever the host or the buttons asked for.
+ *
+ * @param   prev
+ *          Mask currently on the outputs.
+ */
+void Rules_Apply(const uint8_t *prev, uint8_t *mask);
+
+/**
+ * @brief   Store rules from first on, of a table of count rules.
+ *
+ * Rules are checked and kept in RAM as they arrive. Once the last one is
+ * in, Rules_Poll() writes the table to EEPROM while the table loaded
+ * before stays in use.
+ *
+ * @param   next
+ *          First rule expected in the next request, or the rule refused.
+ * @return  RULES_OK, RULES_INVALID or RULES_ORDER.
+ */
+uint8_t Rules_Store(uint8_t first, uint8_t count, const uint8_t *data, uint8_t length, uint8_t *next);
+
+/**
+ * @brief   A complete table is waiting to be written by Rules_Poll().
+ */
+bool Rules_Committing(void);
+
+/**
+ * @brief   Write one byte of a stored table to EEPROM, at most 3.3 ms.
+ *
+ * Pulses running when the new table takes over carry on under a rule of
+ * the same kind on the same relay; the next Rules_Apply() switches the
+ * relays of the others off.
+ *
+ * @return  true once, when the table is written and has replaced the one
+ *          in use.
+ */
+bool Rules_Poll(void);
+
+/**
+ * @brief   Rules in use.
+ */
+uint8_t Rules_Count(void);
+
+/**
+ * @brief   Rule n with its hit counter, false past the end of the table.
+ */
+bool Rules_Get(uint8_t n, struct msg_rule_stat *stat);
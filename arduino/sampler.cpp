@@ -0,0 +1,108 @@
+#include "sampler.h"
+
+static volatile uint8_t *in_reg[SAMPLE_MAX_INPUTS];
+static uint8_t in_mask[SAMPLE_MAX_INPUTS];
+static uint8_t n_inputs;
+
+// Double buffer: the interrupt fills one batch while the other is sent
+static struct sample_batch batches[2];
+static volatile bool full[2];
+static uint8_t fill;
+static uint8_t fill_count;
+static uint16_t seq;
+
+void Sample_Input(uint8_t bit, uint8_t pin)
+{
+	if (bit >= SAMPLE_MAX_INPUTS) {
+		return;
+	}
+	uint8_t port = digitalPinToPort(pin);
+	in_reg[bit] = portInputRegister(port);
+	in_mask[bit] = digitalPinToBitMask(pin);
+	if (bit >= n_inputs) {
+		n_inputs = bit + 1;
+	}
+}
+
+uint16_t Sample_Start(uint16_t rate)
+{
+	uint16_t actual = 0;
+
+	noInterrupts();
+	TIMSK1 &= ~(1 << OCIE1A);
+	TCCR1A = 0;
+	TCCR1B = 0;
+	TCNT1 = 0;
+
+	full[0] = false;
+	full[1] = false;
+	fill = 0;
+	fill_count = 0;
+	seq = 0;
+
+	if (rate > 0) {
+		if (rate < SAMPLE_MIN_RATE) {
+			rate = SAMPLE_MIN_RATE;
+		} else if (rate > SAMPLE_MAX_RATE) {
+			rate = SAMPLE_MAX_RATE;
+		}
+		uint16_t period = (F_CPU / 8) / rate;
+		actual = (F_CPU / 8) / period;
+
+		// CTC on OCR1A, prescaler 8
+		OCR1A = period - 1;
+		TCCR1B = (1 << WGM12) | (1 << CS11);
+		TIMSK1 |= (1 << OCIE1A);
+	}
+	interrupts();
+
+	return actual;
+}
+
+const struct sample_batch *Sample_Next(void)
+{
+	// The interrupt never fills a batch while the other one is full,
+	// so at most one is waiting
+	if (full[0]) {
+		return &batches[0];
+	}
+	if (full[1]) {
+		return &batches[1];
+	}
+	return NULL;
+}
+
+void Sample_Release(const struct sample_batch *batch)
+{
+	full[batch - &batches[0]] = false;
+}
+
+ISR(TIMER1_COMPA_vect)
+{
+	uint8_t sample = 0;
+	for (uint8_t i = 0; i < n_inputs; i++) {
+		if (*in_reg[i] & in_mask[i]) {
+			sample |= (1 << i);
+		}
+	}
+
+	struct sample_batch *batch = &batches[fill];
+	if (fill_count == 0) {
+		batch->timestamp = micros();
+	}
+	if (fill_count & 1) {
+		batch->data[fill_count >> 1] |= (sample << SAMPLE_BITS);
+	} else {
+		batch->data[fill_count >> 1] = sample;
+	}
+
+	if (++fill_count == SAMPLE_BATCH) {
+		fill_count = 0;
+		batch->seq = seq++;
+		// Overrun: the sender still holds the other buffer, reuse this one
+		if (!full[fill ^ 1]) {
+			full[fill] = true;
+			fill ^= 1;
+		}
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <Arduino.h>
+#include "messages.h"
+
+#define SAMPLE_MAX_INPUTS  4
+// Samples are packed as SAMPLE_BITS nibbles, see messages.h
+#define SAMPLE_BYTES       SAMPLES_DATA
+#define SAMPLE_BATCH       (SAMPLE_BYTES * 8 / SAMPLE_BITS)
+// Timer1 runs at F_CPU / 8, its 16-bit compare register sets the lowest rate
+#define SAMPLE_MIN_RATE    ((F_CPU / 8 + 65535) / 65536)
+// A packed batch every 64 samples uses about half of 115200 baud
+#define SAMPLE_MAX_RATE    8000
+
+struct sample_batch {
+	uint16_t seq;         // batch number since the stream started, gaps are lost batches
+	uint32_t timestamp;   // micros() of the first sample
+	uint8_t data[SAMPLE_BYTES];
+};
+
+/**
+ * @brief   Sample the given pin as input number bit.
+ *
+ * The port register and mask are looked up once so that the sampling
+ * interrupt reads the raw level without digitalRead().
+ */
+void Sample_Input(uint8_t bit, uint8_t pin);
+
+/**
+ * @brief   Start sampling every input at rate Hz on Timer1, 0 stops.
+ *
+ * @return  The rate actually programmed, after clamping and rounding of the
+ *          timer period, 0 when stopped.
+ */
+uint16_t Sample_Start(uint16_t rate);
+
+/**
+ * @brief   Complete batch waiting to be sent, NULL if none.
+ *
+ * The batch stays reserved until Sample_Release(). If the interrupt
+ * completes the next batch before that, the new batch is dropped and
+ * only its sequence number is used.
+ */
+const struct sample_batch *Sample_Next(void);
+
+/**
+ * @brief   Give a batch returned by Sample_Next() back to the interrupt.
+ */
+void Sample_Release(const struct sample_batch *batch);
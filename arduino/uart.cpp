@@ -1,10 +1,27 @@
 
 #include "uart.h"
 
+//receive parser states
+#define RX_START     0
+#define RX_LENGTH    1
+#define RX_DATA      2
+#define RX_ID        3
+#define RX_VALUE     4
+#define RX_CHECKSUM  5
+#define RX_END       6
+
 //initialize the UartComms class
 void UartComms::begin(Stream &stream)
 {
 	_serial = &stream;
+	//nothing has been written yet, so all of it is free
+	txCapacity = _serial->availableForWrite();
+}
+
+//true once everything written so far has left the transmit buffer
+bool UartComms::txIdle()
+{
+	return _serial->availableForWrite() >= txCapacity;
 }
 
 //change the UART buffer timeout (10ms by default)
@@ -13,57 +30,55 @@ void UartComms::setReceiveTimout(uint8_t _timeout)
 	timeout = _timeout;
 }
 
-//find 8-bit checksum of message
-uint8_t UartComms::calculateChecksum(uint8_t len, uint8_t *buff)
+//add one byte to the 8-bit checksum of a message
+uint8_t UartComms::updateChecksum(uint8_t crc, uint8_t inbyte)
 {
-	uint8_t crc = 0;
-	for (uint8_t i = 0; i < len; i++) {
-		uint8_t inbyte = buff[i];
-		for (uint8_t j = 0; j < 8; j++) {
-			uint8_t mix = (crc ^ inbyte) & 0x01;
-			crc >>= 1;
-			if (mix) {
-				crc ^= 0x8C;
-			}
-			inbyte >>= 1;
+	for (uint8_t j = 0; j < 8; j++) {
+		uint8_t mix = (crc ^ inbyte) & 0x01;
+		crc >>= 1;
+		if (mix) {
+			crc ^= 0x8C;
 		}
+		inbyte >>= 1;
 	}
 	return crc;
 }
 
-//send a selection of data from outgoingArray
-bool UartComms::sendData(uint8_t data_len)
+//send a selection of data from frameArray, encoding it on the fly
+bool UartComms::sendData(uint8_t data_len, bool packed)
 {
 	// Length higher than expected
 	if (data_len > DATA_LEN) {
 		return false;
 	}
 
-	uint8_t buff_len = data_len * 2;
-	uint8_t auxBuff[BUFF_LEN];
-	// Update auxiliar buffer
-	{
-		uint8_t j = 0;
-		for (uint8_t i = 0; i < data_len; i++) {
-			auxBuff[j++] = i; // message ID
-			auxBuff[j++] = outgoingArray[i];
-		}
-	}
-
-	//update checksum before sending dataframe
-	uint8_t checksum = calculateChecksum(buff_len, &auxBuff[0]);
+	uint8_t crc = 0;
 
 	//send START_BYTE
 	_serial->write(START_BYTE);
 
-	//send payload data_len in bytes
-	_serial->write(buff_len);
+	if (packed) {
+		//send payload data_len in bytes and the raw data
+		_serial->write(data_len | PACKED_FLAG);
+		_serial->write(&frameArray[0], data_len);
+		for (uint8_t i = 0; i < data_len; i++) {
+			crc = updateChecksum(crc, frameArray[i]);
+		}
+	} else {
+		//send payload data_len in bytes
+		_serial->write(data_len * 2);
 
-	//send payload
-	_serial->write(&auxBuff[0], buff_len);
+		//send payload as message ID / raw data pairs
+		for (uint8_t i = 0; i < data_len; i++) {
+			_serial->write(i);
+			_serial->write(frameArray[i]);
+			crc = updateChecksum(crc, i);
+			crc = updateChecksum(crc, frameArray[i]);
+		}
+	}
 
 	//send checksum
-	_serial->write(checksum);
+	_serial->write(crc);
 
 	//send END_BYTE
 	_serial->write(END_BYTE);
@@ -71,115 +86,106 @@ bool UartComms::sendData(uint8_t data_len)
 	return true;
 }
 
-//update incomingArray with new data if available
+//update frameArray with new data if available
 int8_t UartComms::getData()
 {
-	uint32_t startTime = 0;
-	uint32_t endTime = 0;
-
-	uint8_t payloadLen = 0;
-
-	bool startFound = false;
-
-	//see if any data is in the serial buffer
-	if (_serial->available()) {
-		startTime = millis();
-		endTime = millis();
-
-		//process only what bytes are currently in the buffer when looking for the START_BYTE
-		while (_serial->available()) {
-			//check if any bytes in the buffer are 
-			if (_serial->read() == START_BYTE) {
-				//start of a dataframe has been found - time to start looking for the data
-				startFound = true;
-
-				//break the "while available" loop
-				break;
-			}
-
-			//update timer
-			endTime = millis();
-
-			//test for timeout
-			if ((endTime - startTime) >= timeout) {
-				//oops, data didn't arrive on time - better get back to processing other things
-				return TIMEOUT_ERROR;
-			}
+	//process only the bytes already received, a dataframe still arriving is continued on the next call
+	while (_serial->available()) {
+		int8_t report = feedByte(_serial->read());
+		if (report != NO_DATA) {
+			return report;
 		}
+	}
 
-		//determine if the start of frame byte was found
-		if (startFound) {
-			//wait for the payload byte
-			while (_serial->available() == 0);
+	//oops, the rest of the dataframe didn't arrive on time - the next START_BYTE begins a new one
+	if ((rxState != RX_START) && ((millis() - rxStartMs) >= timeout)) {
+		rxState = RX_START;
+		return TIMEOUT_ERROR;
+	}
 
-			//read in the number of bytes in the payload of the packet
-			payloadLen = _serial->read();
+	//no complete dataframe yet
+	return NO_DATA;
+}
 
-			//sanity check for the payload length (should be a multiple of 2 - 1 byte for ID, 1 for raw data)
-			if ((payloadLen > (DATA_LEN * 2)) || (payloadLen % 2)) {
-				//oops, bad payload length value
-				return PAYLOAD_ERROR;
+//advance the receive parser by one byte, NO_DATA until a dataframe ends
+int8_t UartComms::feedByte(uint8_t value)
+{
+	switch (rxState) {
+		case RX_START:
+			//garbage bytes between dataframes are skipped
+			if (value == START_BYTE) {
+				rxStartMs = millis();
+				rxStartTime = micros();
+				rxState = RX_LENGTH;
 			}
-
-			//prime the timeout timer
-			startTime = millis();
-			endTime = millis();
-
-			//wait for rest of dataframe to arrive with timeout
-			while (_serial->available() < (payloadLen + 2)) {  //add 2 (1 for checksum and 1 for END_BYTE)
-				//update timer
-				endTime = millis();
-
-				//test for timeout
-				if ((endTime - startTime) >= timeout) {
-					//oops, data didn't arrive on time - better get back to processing other things
-					return TIMEOUT_ERROR;
+			return NO_DATA;
+
+		case RX_LENGTH:
+			rxCrc = 0;
+			rxPos = 0;
+			if (value & PACKED_FLAG) {
+				//raw data bytes in order, no message IDs
+				rxLen = value & ~PACKED_FLAG;
+				if (rxLen > DATA_LEN) {
+					rxState = RX_START;
+					return PAYLOAD_ERROR;
 				}
+				rxState = RX_DATA;
+			} else {
+				//sanity check for the payload length (should be a multiple of 2 - 1 byte for ID, 1 for raw data)
+				rxLen = value;
+				if ((rxLen > (DATA_LEN * 2)) || (rxLen % 2)) {
+					rxState = RX_START;
+					return PAYLOAD_ERROR;
+				}
+				rxState = RX_ID;
 			}
-
-			uint8_t auxBuff[BUFF_LEN];
-			//stuff all payload bytes in the buffer for processing
-			for (uint8_t i = 0; i < payloadLen; i++) {
-				auxBuff[i] = _serial->read();
+			if (rxLen == 0) {
+				rxState = RX_CHECKSUM;
 			}
+			return NO_DATA;
 
-			//update checksum before processing
-			uint8_t checksum = calculateChecksum(payloadLen, &auxBuff[0]);
-
-			//test received checksum
-			if (_serial->read() != checksum) {
-				//dang, checksums don't match - can't trust the data - get back to the main code
+		case RX_DATA:
+			rxCrc = updateChecksum(rxCrc, value);
+			rxArray[rxPos++] = value;
+			if (rxPos == rxLen) {
+				rxState = RX_CHECKSUM;
+			}
+			return NO_DATA;
+
+		case RX_ID:
+			rxCrc = updateChecksum(rxCrc, value);
+			rxId = value;
+			rxState = RX_VALUE;
+			return NO_DATA;
+
+		case RX_VALUE:
+			rxCrc = updateChecksum(rxCrc, value);
+			//sanity check for messageID
+			if (rxId < DATA_LEN) {
+				rxArray[rxId] = value;
+			}
+			rxPos += 2;
+			rxState = (rxPos == rxLen) ? RX_CHECKSUM : RX_ID;
+			return NO_DATA;
+
+		case RX_CHECKSUM:
+			if (value != rxCrc) {
+				//dang, checksums don't match - can't trust the data
+				rxState = RX_START;
 				return CHECKSUM_ERROR;
 			}
+			rxState = RX_END;
+			return NO_DATA;
 
-			//test END_BYTE
-			if (_serial->read() != END_BYTE) {
-				//ugh, END_BYTE wasn't found in the right spot - can't trust the data - get back to the main code
+		default:
+			rxState = RX_START;
+			if (value != END_BYTE) {
+				//ugh, END_BYTE wasn't found in the right spot - can't trust the data
 				return END_BYTE_ERROR;
 			}
-
-			//process raw data and stuff into dataArray only if all data validity tests are passed
-			processData(payloadLen, &auxBuff[0]);
-
 			//nocie, everything checked out
+			memcpy(&frameArray[0], &rxArray[0], DATA_LEN);
 			return 1;
-		} else {
-			//looks like we had garbage bytes in the serial buffer
-			return SERIAL_BUFF_ERROR;
-		}
-	}
-
-	//no bytes to process
-	return NO_DATA;
-}
-
-void UartComms::processData(uint8_t payloadLen, uint8_t *buff)
-{
-	//check if payloadLen is valid
-	for (uint8_t i = 0; i < payloadLen; i = i + 2) {
-		//sanity check for messageID
-		if (buff[i] <= DATA_LEN) {
-			incomingArray[buff[i]] = (buff[i + 1]);
-		}
 	}
 }
@@ -8,6 +8,7 @@
 #define BUFF_LEN    DATA_LEN * 2
 #define START_BYTE  0x7E  //dataframe start byte
 #define END_BYTE    0xEF  //dataframe end byte
+#define PACKED_FLAG 0x80  //length byte flag: raw data bytes without message IDs
 
 //incoming serial data/parsing errors
 #define NO_DATA              0
@@ -20,28 +21,42 @@
 class UartComms
 {
 public:
-	//data received
-	uint8_t incomingArray[DATA_LEN] = { 0 };
-	//data to send
-	uint8_t outgoingArray[DATA_LEN] = { 0 };
+	//shared frame buffer: a checked dataframe is copied in on receive, encoded in place on send
+	//its contents are only valid after getData() returns 1
+	uint8_t frameArray[DATA_LEN] = { 0 };
+	//micros() when the start byte of the last dataframe was read
+	uint32_t rxStartTime = 0;
 	//initialize the UartComms class
 	void begin(Stream& stream);
 	//change the UART buffer timeout (10ms by default)
 	void setReceiveTimout(uint8_t timeout);
-	//send a selection of data from outgoingArray
-	bool sendData(uint8_t data_len);
-	//update incomingArray with new data if available
+	//send a selection of data from frameArray, packed frames leave out the message IDs
+	bool sendData(uint8_t data_len, bool packed = false);
+	//update frameArray with new data if available, without waiting for the rest of a dataframe
 	int8_t getData();
+	//true once everything written so far has left the transmit buffer
+	bool txIdle();
 
 private:
 	//serial stream
 	Stream* _serial;
-	//receive timeout of 10ms by default
-	uint16_t timeout = 1000;
-	//find 8 - bit checksum of message
-	uint8_t calculateChecksum(uint8_t len, uint8_t *buff);
-	//process raw data and stuff into dataArray
-	void processData(uint8_t payloadLen, uint8_t *buff);
+	//receive timeout of 10ms by default, a dataframe takes 7.3ms at 115200 baud
+	uint16_t timeout = 10;
+	//free space of the empty transmit buffer
+	int16_t txCapacity = 0;
+	//dataframe being received, moved to frameArray once checked: answers
+	//and events are encoded in frameArray meanwhile
+	uint8_t rxArray[DATA_LEN] = { 0 };
+	uint8_t rxState = 0;
+	uint8_t rxLen = 0;
+	uint8_t rxPos = 0;
+	uint8_t rxId = 0;
+	uint8_t rxCrc = 0;
+	uint32_t rxStartMs = 0;
+	//add one byte to the 8-bit checksum of a message
+	uint8_t updateChecksum(uint8_t crc, uint8_t inbyte);
+	//advance the receive parser by one byte
+	int8_t feedByte(uint8_t value);
 };
 
 #endif
@@ -0,0 +1,80 @@
+#ifndef BitMask_cpp
+#define BitMask_cpp
+
+#include <stdint.h>
+#include <string.h>
+
+//relays a board can report, the stats answer holds (channels + 7) / 8 mask bytes
+#define MAX_CHANNELS  64
+
+//channel n is bit n % 8 of byte n / 8, the layout used on the wire and by
+//the firmware output banks
+template <uint8_t N>
+class BitMask
+{
+public:
+	static const uint8_t bytes = (N + 7) / 8;
+
+	BitMask()
+	{
+		clear();
+	}
+
+	void clear(void)
+	{
+		memset(_data, 0, bytes);
+	}
+
+	bool get(uint8_t n) const
+	{
+		return (_data[n >> 3] >> (n & 7)) & 1;
+	}
+
+	void set(uint8_t n, bool value)
+	{
+		if (value) {
+			_data[n >> 3] |= (1 << (n & 7));
+		} else {
+			_data[n >> 3] &= ~(1 << (n & 7));
+		}
+	}
+
+	void toggle(uint8_t n)
+	{
+		_data[n >> 3] ^= (1 << (n & 7));
+	}
+
+	//copy len bytes in wire layout, the channels past them are cleared
+	void load(const uint8_t *src, uint32_t len)
+	{
+		clear();
+		memcpy(_data, src, (len < bytes) ? len : bytes);
+	}
+
+	const uint8_t *raw(void) const
+	{
+		return _data;
+	}
+
+	uint8_t *raw(void)
+	{
+		return _data;
+	}
+
+	bool operator==(const BitMask &other) const
+	{
+		return memcmp(_data, other._data, bytes) == 0;
+	}
+
+	bool operator!=(const BitMask &other) const
+	{
+		return !(*this == other);
+	}
+
+private:
+	uint8_t _data[bytes];
+};
+
+typedef BitMask<MAX_CHANNELS> RelayMask;
+
+#endif
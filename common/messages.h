@@ -0,0 +1,328 @@
+#ifndef Messages_cpp
+#define Messages_cpp
+
+#include <stdint.h>
+#include <string.h>
+
+//message schema shared by the firmware and the host
+//
+//a dataframe carries a message: type, payload length and payload. Payload
+//fields are packed and little endian whatever the compiler and byte order
+//of either side. Each payload is listed once below as (codec, name) pairs;
+//MSG_SCHEMA turns the list into a struct with a compile-time size and
+//encode()/decode() working straight on the frame bytes.
+
+#define HEADER_MSG      2
+#define MSG_MAX_PAYLOAD 38
+
+#define MSG_GETSTATS    1
+#define MSG_SETDO       2
+#define MSG_TEST        3
+#define MSG_TIMESYNC    4
+#define MSG_EVENT       5
+#define MSG_BULK        6
+#define MSG_BULK_ACK    7
+#define MSG_MEMSTATS    8
+#define MSG_SAMPLE_CTL  9
+#define MSG_SAMPLES     10
+//payload of messages back to back, answered with a container of their
+//answers sent as a packed frame
+#define MSG_CONTAINER   11
+//times of the stages of the frame carrying it, put last in a container to
+//cover the handling of everything before it
+#define MSG_TRACE       12
+//load rules into the device, answered with a msg_rules_ack
+#define MSG_RULES_SET   13
+//read rules back with their hit counters
+#define MSG_RULES_GET   14
+#define MSG_TYPES       15
+
+#define BULK_HEADER     6
+#define BULK_FRAG       (MSG_MAX_PAYLOAD - BULK_HEADER)
+#define BULK_OK         0
+#define BULK_RETRY      1
+#define BULK_TOOBIG     2
+
+#define EDGE_FALLING    0b10
+#define EDGE_RISING     0b01
+
+//packed input samples in a MSG_SAMPLES, two per byte: input n in bit n
+//of a nibble, the first sample of a pair in the low nibble
+#define SAMPLES_DATA    32
+#define SAMPLE_BITS     4
+
+//rules the device keeps in EEPROM and evaluates every loop pass
+#define RULES_MAX       16
+#define RULE_EDGE       1   //input edge switches relay, arg is a RULE_ON/OFF/TOGGLE
+#define RULE_PULSE      2   //input edge turns relay on for arg ms, every edge restarts it
+#define RULE_ONESHOT    3   //as RULE_PULSE, edges while it runs are ignored
+#define RULE_MUTEX      4   //relays of group `input` are on one at a time
+#define RULE_FORCE_OFF  5   //relay `input` off forces relay off
+#define RULE_KINDS      6
+
+#define RULE_OFF        0
+#define RULE_ON         1
+#define RULE_TOGGLE     2
+
+#define RULES_OK        0
+#define RULES_INVALID   1   //rule `next` refused, the table is left as it was
+#define RULES_ORDER     2   //rules must be sent from `next` on
+
+struct st_msg {
+	uint8_t type;
+	uint8_t length;
+	uint8_t payload[MSG_MAX_PAYLOAD];
+};
+
+//bytes up to the end of the payload, pointing into the frame
+struct msg_tail {
+	const uint8_t *data;
+	uint8_t length;
+};
+
+//N bytes, pointing into the frame
+template <uint8_t N>
+struct msg_bytes {
+	const uint8_t *data;
+};
+
+//field codecs: size is the least a field takes, span() what a decoded
+//field took, put() returns the bytes written, at most avail
+template <typename T>
+struct MsgCodec;
+
+template <>
+struct MsgCodec<uint8_t> {
+	static const uint8_t size = 1;
+	static uint8_t get(const uint8_t *p, uint8_t)
+	{
+		return p[0];
+	}
+	static uint8_t span(uint8_t)
+	{
+		return 1;
+	}
+	static uint8_t put(uint8_t *p, uint8_t, uint8_t value)
+	{
+		p[0] = value;
+		return 1;
+	}
+};
+
+template <>
+struct MsgCodec<uint16_t> {
+	static const uint8_t size = 2;
+	static uint16_t get(const uint8_t *p, uint8_t)
+	{
+		return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+	}
+	static uint8_t span(uint16_t)
+	{
+		return 2;
+	}
+	static uint8_t put(uint8_t *p, uint8_t, uint16_t value)
+	{
+		p[0] = (uint8_t)value;
+		p[1] = (uint8_t)(value >> 8);
+		return 2;
+	}
+};
+
+template <>
+struct MsgCodec<uint32_t> {
+	static const uint8_t size = 4;
+	static uint32_t get(const uint8_t *p, uint8_t)
+	{
+		return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+	}
+	static uint8_t span(uint32_t)
+	{
+		return 4;
+	}
+	static uint8_t put(uint8_t *p, uint8_t, uint32_t value)
+	{
+		p[0] = (uint8_t)value;
+		p[1] = (uint8_t)(value >> 8);
+		p[2] = (uint8_t)(value >> 16);
+		p[3] = (uint8_t)(value >> 24);
+		return 4;
+	}
+};
+
+template <uint8_t N>
+struct MsgCodec<msg_bytes<N> > {
+	static const uint8_t size = N;
+	static msg_bytes<N> get(const uint8_t *p, uint8_t)
+	{
+		msg_bytes<N> value = { p };
+		return value;
+	}
+	static uint8_t span(msg_bytes<N>)
+	{
+		return N;
+	}
+	static uint8_t put(uint8_t *p, uint8_t, msg_bytes<N> value)
+	{
+		memmove(p, value.data, N);
+		return N;
+	}
+};
+
+//only valid as the last field
+template <>
+struct MsgCodec<msg_tail> {
+	static const uint8_t size = 0;
+	static msg_tail get(const uint8_t *p, uint8_t avail)
+	{
+		msg_tail value = { p, avail };
+		return value;
+	}
+	static uint8_t span(msg_tail value)
+	{
+		return value.length;
+	}
+	static uint8_t put(uint8_t *p, uint8_t avail, msg_tail value)
+	{
+		uint8_t len = (value.length < avail) ? value.length : avail;
+		memmove(p, value.data, len);
+		return len;
+	}
+};
+
+#define MSG_MEMBER(T, name)  T name;
+#define MSG_SIZE(T, name)    + MsgCodec<T>::size
+#define MSG_GET(T, name)     name = MsgCodec<T>::get(&p[pos], length - pos); pos += MsgCodec<T>::span(name);
+#define MSG_PUT(T, name)     pos += MsgCodec<T>::put(&p[pos], MSG_MAX_PAYLOAD - pos, name);
+
+//decode() fails on a payload shorter than size, views point into p.
+//encode() returns the payload length; p may be the buffer decoded from.
+#define MSG_SCHEMA(msg, FIELDS) \
+	struct msg { \
+		FIELDS(MSG_MEMBER) \
+		static const uint8_t size = 0 FIELDS(MSG_SIZE); \
+		bool decode(const uint8_t *p, uint8_t length) \
+		{ \
+			uint8_t pos = 0; \
+			if (length < size) { \
+				return false; \
+			} \
+			FIELDS(MSG_GET) \
+			return true; \
+		} \
+		uint8_t encode(uint8_t *p) const \
+		{ \
+			uint8_t pos = 0; \
+			FIELDS(MSG_PUT) \
+			return pos; \
+		} \
+	}; \
+	static_assert(msg::size <= MSG_MAX_PAYLOAD, #msg " does not fit a frame");
+
+//MSG_SETDO request
+#define FIELDS_DO_VAL(F) \
+	F(uint8_t, do_num) \
+	F(uint8_t, do_val)
+MSG_SCHEMA(msg_do_val, FIELDS_DO_VAL)
+
+//MSG_GETSTATS and MSG_SETDO answer, (channels + 7) / 8 mask bytes
+#define FIELDS_STATS(F) \
+	F(uint32_t, timestamp) \
+	F(uint16_t, boot)      /* changes every time the firmware starts */ \
+	F(uint8_t, rules)      /* rules in use, relays may change without an event */ \
+	F(uint8_t, channels) \
+	F(msg_tail, do_mask)
+MSG_SCHEMA(msg_stats, FIELDS_STATS)
+
+//MSG_TIMESYNC request and answer, t1 is echoed back untouched
+#define FIELDS_TIMESYNC(F) \
+	F(uint32_t, t1) /* host send time */ \
+	F(uint32_t, t2) /* device receive time */ \
+	F(uint32_t, t3) /* device send time */
+MSG_SCHEMA(msg_timesync, FIELDS_TIMESYNC)
+
+#define FIELDS_EVENT(F) \
+	F(uint8_t, di_num) \
+	F(uint8_t, edge) \
+	F(uint32_t, timestamp)
+MSG_SCHEMA(msg_event, FIELDS_EVENT)
+
+#define FIELDS_BULK(F) \
+	F(uint8_t, xfer)     /* transfer id */ \
+	F(uint8_t, type)     /* message type of the reassembled payload */ \
+	F(uint16_t, total)   /* reassembled payload length */ \
+	F(uint16_t, offset)  /* position of this fragment */ \
+	F(msg_tail, data)
+MSG_SCHEMA(msg_bulk, FIELDS_BULK)
+
+#define FIELDS_BULK_ACK(F) \
+	F(uint8_t, xfer) \
+	F(uint8_t, status) \
+	F(uint16_t, next)    /* next expected offset */
+MSG_SCHEMA(msg_bulk_ack, FIELDS_BULK_ACK)
+
+#define FIELDS_MEMSTATS(F) \
+	F(uint16_t, free_ram)    /* between heap and stack pointer */ \
+	F(uint16_t, stack_max)   /* stack high-water mark since reset */ \
+	F(uint16_t, static_ram)  /* .data and .bss */ \
+	F(uint16_t, samples_deferred)  /* sample batches that found the line busy */ \
+	F(uint32_t, samples_wait)      /* longest wait of a batch for the line, in us */ \
+	F(uint16_t, bulk_deferred)     /* bulk fragments that found the line busy */ \
+	F(uint32_t, bulk_wait)
+MSG_SCHEMA(msg_memstats, FIELDS_MEMSTATS)
+
+//request and answer, which holds the actual rate
+#define FIELDS_SAMPLE_CTL(F) \
+	F(uint16_t, rate)    /* in Hz, 0 stops */ \
+	F(uint8_t, inputs)   /* inputs in each sample */ \
+	F(uint8_t, batch)    /* samples in each MSG_SAMPLES */
+MSG_SCHEMA(msg_sample_ctl, FIELDS_SAMPLE_CTL)
+
+#define FIELDS_SAMPLES(F) \
+	F(uint16_t, seq)         /* batch number, gaps are lost batches */ \
+	F(uint32_t, timestamp)   /* device time of the first sample */ \
+	F(msg_bytes<SAMPLES_DATA>, data)
+MSG_SCHEMA(msg_samples, FIELDS_SAMPLES)
+
+#define FIELDS_TRACE(F) \
+	F(uint32_t, rx_first)    /* start byte read */ \
+	F(uint32_t, rx_checked)  /* checksum verified */ \
+	F(uint32_t, dispatched)  /* messages before this one handled */
+MSG_SCHEMA(msg_trace, FIELDS_TRACE)
+
+//one rule, also its layout in EEPROM; inputs and relays count from 0
+#define FIELDS_RULE(F) \
+	F(uint8_t, kind) \
+	F(uint8_t, input)    /* input, group or relay the rule watches */ \
+	F(uint8_t, edge)     /* EDGE_RISING and/or EDGE_FALLING */ \
+	F(uint8_t, relay)    /* relay the rule drives */ \
+	F(uint16_t, arg)
+MSG_SCHEMA(msg_rule, FIELDS_RULE)
+
+#define FIELDS_RULE_STAT(F) \
+	FIELDS_RULE(F) \
+	F(uint16_t, hits)    /* times the rule fired since it was loaded */
+MSG_SCHEMA(msg_rule_stat, FIELDS_RULE_STAT)
+
+//MSG_RULES_SET request, msg_rule from first on, the table ends up with
+//count rules and is stored once the last one arrives; that request is
+//answered only when the table is in EEPROM. MSG_RULES_GET answer,
+//msg_rule_stat from first on.
+#define FIELDS_RULES(F) \
+	F(uint8_t, first) \
+	F(uint8_t, count) \
+	F(msg_tail, data)
+MSG_SCHEMA(msg_rules, FIELDS_RULES)
+
+#define FIELDS_RULES_ACK(F) \
+	F(uint8_t, next)     /* first rule of the next request */ \
+	F(uint8_t, status)
+MSG_SCHEMA(msg_rules_ack, FIELDS_RULES_ACK)
+
+#define FIELDS_RULES_GET(F) \
+	F(uint8_t, first)
+MSG_SCHEMA(msg_rules_get, FIELDS_RULES_GET)
+
+#define RULES_PER_SET   ((MSG_MAX_PAYLOAD - msg_rules::size) / msg_rule::size)
+#define RULES_PER_GET   ((MSG_MAX_PAYLOAD - msg_rules::size) / msg_rule_stat::size)
+
+#endif
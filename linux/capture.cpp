@@ -0,0 +1,211 @@
+#include <fcntl.h>      // File control definitions
+#include <unistd.h>     // UNIX standard function definitions
+#include <string.h>     // string function definitions
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include "capture.h"
+#include "timesync.h"
+
+static uint32_t put_varint(uint8_t *buff, uint64_t value)
+{
+	uint32_t len = 0;
+	while (value >= 0x80) {
+		buff[len++] = (uint8_t)(value | 0x80);
+		value >>= 7;
+	}
+	buff[len++] = (uint8_t)value;
+	return len;
+}
+
+Capture::~Capture()
+{
+	if (fd >= 0) {
+		flush();
+		close(fd);
+	}
+}
+
+int32_t Capture::open(const char *filename)
+{
+	fd = ::open(filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if (fd < 0) {
+		std::cerr << "Capture file " << filename << " cannot be opened." << std::endl;
+		return -1;
+	}
+
+	// Deltas are relative to the previous record of the session, records of
+	// two sessions interleaved in one file would get each other's times
+	if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+		std::cerr << "Capture file " << filename << " is in use by another process." << std::endl;
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+
+	uint8_t buff[CAPTURE_HEADER + 10] = { 0 };
+	uint32_t len = 0;
+
+	// New files start with the header
+	struct stat st;
+	if ((fstat(fd, &st) == 0) && (st.st_size == 0)) {
+		memcpy(&buff[0], CAPTURE_MAGIC, 4);
+		buff[4] = CAPTURE_VERSION;
+		len = CAPTURE_HEADER;
+	}
+
+	last_us = monotonic_us();
+	len += put_varint(&buff[len], (last_us << 2) | CAPTURE_SESSION);
+	if (::write(fd, buff, len) != (ssize_t)len) {
+		std::cerr << "Capture file " << filename << " cannot be written." << std::endl;
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void Capture::record(uint8_t dir, const uint8_t *data, uint32_t length)
+{
+	if (fd < 0) {
+		return;
+	}
+
+	uint64_t now = monotonic_us();
+
+	// Bytes of one USB transfer are read one by one, keep them together
+	if ((pending_len > 0) && ((dir != pending_dir) ||
+	    (now - last_byte_us > CAPTURE_MERGE_US) || (pending_len + length > CAPTURE_MAX))) {
+		flush();
+	}
+
+	if (pending_len == 0) {
+		pending_dir = dir;
+		pending_us = now;
+	}
+
+	while (length > 0) {
+		uint32_t len = (length > CAPTURE_MAX - pending_len) ? (CAPTURE_MAX - pending_len) : length;
+		memcpy(&pending[pending_len], data, len);
+		pending_len += len;
+		data += len;
+		length -= len;
+		if (length > 0) {
+			flush();
+			pending_dir = dir;
+			pending_us = now;
+		}
+	}
+	last_byte_us = now;
+}
+
+void Capture::flush(void)
+{
+	if ((fd < 0) || (pending_len == 0)) {
+		return;
+	}
+
+	uint8_t buff[20 + CAPTURE_MAX];
+	uint32_t len = put_varint(&buff[0], ((pending_us - last_us) << 2) | pending_dir);
+	len += put_varint(&buff[len], pending_len);
+	memcpy(&buff[len], pending, pending_len);
+	len += pending_len;
+
+	if (::write(fd, buff, len) != (ssize_t)len) {
+		std::cerr << "Capture write error" << std::endl;
+	}
+
+	last_us = pending_us;
+	pending_len = 0;
+}
+
+CaptureReader::~CaptureReader()
+{
+	if (map != NULL) {
+		munmap((void *)map, size);
+	}
+}
+
+int32_t CaptureReader::open(const char *filename)
+{
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Capture file " << filename << " cannot be opened." << std::endl;
+		return -1;
+	}
+
+	struct stat st;
+	if ((fstat(fd, &st) < 0) || (st.st_size < CAPTURE_HEADER)) {
+		std::cerr << "Capture file " << filename << " is empty." << std::endl;
+		close(fd);
+		return -1;
+	}
+	size = st.st_size;
+
+	void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		std::cerr << "Capture file " << filename << " cannot be mapped." << std::endl;
+		return -1;
+	}
+	madvise(addr, size, MADV_SEQUENTIAL);
+	map = (const uint8_t *)addr;
+
+	if ((memcmp(map, CAPTURE_MAGIC, 4) != 0) || (map[4] != CAPTURE_VERSION)) {
+		std::cerr << "Capture file " << filename << " has an unknown format." << std::endl;
+		return -1;
+	}
+
+	rewind();
+	return 0;
+}
+
+void CaptureReader::rewind(void)
+{
+	pos = CAPTURE_HEADER;
+	ts = 0;
+}
+
+bool CaptureReader::varint(uint64_t *value)
+{
+	*value = 0;
+	for (uint32_t shift = 0; (pos < size) && (shift < 64); shift += 7) {
+		uint8_t byte = map[pos++];
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		if ((byte & 0x80) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool CaptureReader::next(struct capture_record *rec)
+{
+	uint64_t tag;
+	if (!varint(&tag)) {
+		return false;
+	}
+
+	rec->dir = tag & 0x03;
+	if (rec->dir == CAPTURE_SESSION) {
+		ts = tag >> 2;
+		rec->ts_us = ts;
+		rec->length = 0;
+		rec->data = NULL;
+		return true;
+	}
+
+	uint64_t length;
+	if (!varint(&length) || (length > size - pos)) {
+		return false;
+	}
+
+	ts += tag >> 2;
+	rec->ts_us = ts;
+	rec->length = length;
+	rec->data = &map[pos];
+	pos += length;
+	return true;
+}
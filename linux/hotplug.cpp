@@ -0,0 +1,83 @@
+#include <unistd.h>     // UNIX standard function definitions
+#include <poll.h>
+#include <sys/inotify.h>
+#include <iostream>
+#include "hotplug.h"
+#include "timesync.h"
+
+Hotplug::~Hotplug()
+{
+	if (_inotify_fd >= 0) {
+		close(_inotify_fd);
+	}
+}
+
+int32_t Hotplug::watch(const char *path)
+{
+	_path = path;
+	_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (_inotify_fd < 0) {
+		std::cerr << "Hot-plug watch cannot be started" << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+void Hotplug::arm(void)
+{
+	// /dev/serial/by-id itself disappears with the last adapter, so walk up
+	// to a directory that exists; adding an existing watch is a no-op
+	std::string dir = _path;
+	while (true) {
+		size_t slash = dir.find_last_of('/');
+		if (slash == std::string::npos) {
+			dir = ".";
+		} else {
+			dir = (slash == 0) ? "/" : dir.substr(0, slash);
+		}
+		if (inotify_add_watch(_inotify_fd, dir.c_str(),
+		                      IN_CREATE | IN_ATTRIB | IN_MOVED_TO) >= 0) {
+			return;
+		}
+		if ((dir == "/") || (dir == ".")) {
+			return;
+		}
+	}
+}
+
+void Hotplug::drain(void)
+{
+	char events[4096];
+	while (read(_inotify_fd, events, sizeof(events)) > 0);
+}
+
+bool Hotplug::waitPresent(uint32_t timeout_ms)
+{
+	uint64_t deadline = monotonic_us() + (uint64_t)timeout_ms * 1000;
+
+	while (true) {
+		// udev creates the node first and fixes its permissions after
+		if (access(_path.c_str(), R_OK | W_OK) == 0) {
+			return true;
+		}
+
+		uint64_t now = monotonic_us();
+		if (now >= deadline) {
+			return false;
+		}
+		uint64_t wait_ms = (deadline - now + 999) / 1000;
+		if (wait_ms > HOTPLUG_RECHECK_MS) {
+			wait_ms = HOTPLUG_RECHECK_MS;
+		}
+
+		if (_inotify_fd >= 0) {
+			arm();
+			struct pollfd pfd = { _inotify_fd, POLLIN, 0 };
+			if (poll(&pfd, 1, wait_ms) > 0) {
+				drain();
+			}
+		} else {
+			usleep(wait_ms * 1000);
+		}
+	}
+}
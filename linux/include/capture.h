@@ -0,0 +1,74 @@
+#ifndef Capture_cpp
+#define Capture_cpp
+
+#include <stdint.h>
+#include <stddef.h>
+
+//capture file layout:
+//  header:  "UCAP" + version byte + 3 reserved bytes
+//  records: varint(delta_us << 2 | dir) varint(length) data[length]
+//  a CAPTURE_SESSION record carries the absolute CLOCK_MONOTONIC time
+//  instead of a delta and has no length or data; deltas are relative to
+//  the previous record of the session, so one process at a time writes
+//  to a file
+#define CAPTURE_MAGIC     "UCAP"
+#define CAPTURE_VERSION   1
+#define CAPTURE_HEADER    8
+
+#define CAPTURE_RX        0
+#define CAPTURE_TX        1
+#define CAPTURE_SESSION   2
+
+//consecutive bytes in the same direction closer than this share a record
+#define CAPTURE_MERGE_US  50
+#define CAPTURE_MAX       256
+
+class Capture
+{
+public:
+	~Capture();
+	//open a capture file for appending, a new session record is written;
+	//-1 if another process has it open
+	int32_t open(const char *filename);
+	//log bytes read or written
+	void record(uint8_t dir, const uint8_t *data, uint32_t length);
+	//write out the record being merged
+	void flush(void);
+
+private:
+	int32_t fd = -1;
+	uint64_t last_us = 0;       //timestamp of the last record written
+	uint64_t last_byte_us = 0;  //timestamp of the last byte merged
+	uint8_t pending_dir = 0;
+	uint64_t pending_us = 0;
+	uint32_t pending_len = 0;
+	uint8_t pending[CAPTURE_MAX];
+};
+
+struct capture_record {
+	uint64_t ts_us;       //absolute CLOCK_MONOTONIC time
+	uint8_t dir;
+	uint32_t length;
+	const uint8_t *data;  //points into the mapped file
+};
+
+class CaptureReader
+{
+public:
+	~CaptureReader();
+	//map a capture file, -1 if it cannot be read or is not a capture
+	int32_t open(const char *filename);
+	//next record, false at the end of the file or on a truncated record
+	bool next(struct capture_record *rec);
+	//restart from the first record
+	void rewind(void);
+
+private:
+	const uint8_t *map = NULL;
+	size_t size = 0;
+	size_t pos = 0;
+	uint64_t ts = 0;
+	bool varint(uint64_t *value);
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef Hotplug_cpp
+#define Hotplug_cpp
+
+#include <stdint.h>
+#include <string>
+
+//fallback recheck period, in case an inotify event is missed
+#define HOTPLUG_RECHECK_MS  100
+
+class Hotplug
+{
+public:
+	~Hotplug();
+	//watch for the device node or by-id link at path
+	int32_t watch(const char *path);
+	//wait until the device is back and accessible, false after timeout_ms
+	bool waitPresent(uint32_t timeout_ms);
+
+private:
+	int32_t _inotify_fd = -1;
+	std::string _path;
+	//watch the deepest existing directory on the way to the device
+	void arm(void);
+	void drain(void);
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef IoEngine_cpp
+#define IoEngine_cpp
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include "uart.h"
+#include "spsc_ring.h"
+
+#define IO_RING_LEN     64
+#define IO_IDLE_MS      100
+//consumer spins this long before sleeping between checks
+#define IO_SPIN_US      200
+#define IO_SLEEP_US     20
+
+//encoded dataframe on its way to the wire
+struct io_frame {
+	uint32_t length;
+	uint8_t data[FRAME_LEN];
+};
+
+//decoded message from the wire
+struct io_msg {
+	uint64_t rx_us;           //CLOCK_MONOTONIC time the frame was complete
+	uint8_t data[DATA_LEN];
+};
+
+struct io_options {
+	int32_t rt_prio = 0;      //SCHED_FIFO priority of the I/O thread, 0 to keep SCHED_OTHER
+	int32_t cpu = -1;         //CPU to pin the I/O thread to, -1 for any
+	bool mlock = false;       //lock all current and future pages in RAM
+};
+
+class IoEngine
+{
+public:
+	~IoEngine();
+	//hand the stream over to a dedicated I/O thread
+	int32_t start(Stream &stream, const struct io_options &options);
+	void stop(void);
+	bool running(void) const;
+	//the I/O thread stopped because the device went away
+	bool linkLost(void) const;
+	//application thread: queue an encoded frame, false if the ring is full
+	bool send(const struct io_frame &frame);
+	//application thread: next decoded message, false after timeout_us or on link loss
+	bool recv(struct io_msg &msg, uint64_t timeout_us);
+	//frames lost because a ring was full
+	uint64_t rxDrops(void) const;
+	uint64_t txDrops(void) const;
+
+private:
+	Stream *_serial = NULL;
+	UartComms comms;
+	std::thread thread;
+	std::atomic<bool> active{false};
+	std::atomic<bool> lost{false};
+	int32_t wake_fd = -1;
+	struct io_options opts;
+	//application -> I/O thread
+	SpscRing<struct io_frame, IO_RING_LEN> tx;
+	//I/O thread -> application
+	SpscRing<struct io_msg, IO_RING_LEN> rx;
+	std::atomic<uint64_t> rx_drops{0};
+	std::atomic<uint64_t> tx_drops{0};
+	void run(void);
+	void setup(void);
+};
+
+#endif
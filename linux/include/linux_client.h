@@ -1,7 +1,18 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string>
+#include <vector>
+#include <deque>
 #include <uart.h>
+#include <timesync.h>
+#include <capture.h>
+#include <shm_state.h>
+#include <io_engine.h>
+#include <hotplug.h>
+#include <sample_ring.h>
+#include <bitmask.h>
+#include <trace.h>
+#include <messages.h>
 
 class LinuxClient {
 public:
@@ -12,10 +23,122 @@ public:
 	void exec(void);
 
 private:
+	Capture capture;
 	Stream serial;
+	UartComms UART_comms;
+	TimeSync sync;
+	SharedState shared;
+	IoEngine engine;
+	struct io_options io_opts;
+	Hotplug hotplug;
+	SampleRing samples;
+	Trace trace;
+	// commands sent but not yet acknowledged by the device
+	std::deque<struct st_msg> pending;
+	// answers split out of a container, not read yet
+	std::deque<struct st_msg> inbox;
+	// last message taken from the inbox or the I/O thread
+	struct st_msg unpacked;
+	struct io_msg rx_io;
+	// -a and -d in command line order
+	std::vector<struct st_msg> relay_ops;
+	// -r in command line order
+	std::vector<struct msg_rule> rules;
 	std::string dev_port;
+	std::string capture_file;
+	std::string ring_file = SAMPLE_RING_FILE;
+	std::string tail_file;
+	std::string trace_file;
 	bool get_stats = false;
-	bool act_do = false;
-	bool deact_do = false;
-	uint32_t n_do;
+	bool watch = false;
+	bool get_mem = false;
+	bool set_rules = false;
+	bool get_rules = false;
+	bool cached = false;
+	bool io_thread = false;
+	bool low_latency = false;
+	bool reconnecting = false;
+	bool have_state = false;
+	bool have_seq = false;
+	RelayMask known_mask;
+	uint8_t channels = 0;
+	uint32_t known_ts = 0;
+	uint16_t known_boot = 0;
+	uint8_t known_rules = 0;
+	uint32_t sync_count = 0;
+	uint32_t bulk_len = 0;
+	uint32_t fresh_ms = 0;
+	uint8_t bulk_xfer = 0;
+	int32_t sample_rate = -1;
+	uint16_t next_seq = 0;
+	uint64_t last_batch_us = 0;
+
+	// handler of a message nobody is waiting for
+	typedef void (LinuxClient::*msg_handler)(const struct st_msg *msg);
+	struct msg_route {
+		uint8_t type;
+		msg_handler handler;
+	};
+	static const struct msg_route routes[MSG_TYPES];
+	static constexpr bool routes_in_order(uint8_t i)
+	{
+		return (i == MSG_TYPES) || ((routes[i].type == i) && routes_in_order(i + 1));
+	}
+
+	// send data_len bytes of the outgoing buffer as one frame
+	bool send_frame(uint8_t data_len, bool packed);
+	// send a message of the given type and payload
+	bool send_msg(uint8_t type, const void *payload, uint8_t length);
+	// send a message encoded from its schema
+	template <class T>
+	bool send_msg(uint8_t type, const T &payload)
+	{
+		struct st_msg *msg = (struct st_msg *)(&UART_comms.outgoingArray[0]);
+		msg->type = type;
+		msg->length = payload.encode(&msg->payload[0]);
+		return send_frame(msg->length + HEADER_MSG, false);
+	}
+	// send several messages in as few container frames as possible
+	bool send_container(const std::deque<struct st_msg> &msgs);
+	// wait for a message of the given type, handling events meanwhile; it
+	// is left in place and valid until the next call
+	int32_t recv_msg(uint8_t type, const struct st_msg **msg, uint32_t timeout_ms);
+	// send a command and wait until the device acknowledges it
+	int32_t command(uint8_t type, const void *payload, uint8_t length);
+	// send every pending command at once and wait for the acknowledgements
+	int32_t flush_pending(void);
+	// wait for the device to come back, reopen it and resynchronize
+	int32_t reconnect(void);
+	// read the relay state back and replay unacknowledged commands
+	int32_t resync(void);
+	// record relay state reported by the device
+	void update_state(const struct msg_stats &stats);
+	// ask the device for its relay state
+	int32_t read_state(void);
+	// send a large payload as a windowed stream of fragments
+	int32_t bulk_send(uint8_t type, const uint8_t *data, uint16_t length);
+	// reassemble a large payload of the given type
+	int32_t bulk_recv(uint8_t type, std::vector<uint8_t> &data, uint32_t timeout_ms);
+	// run one time synchronization exchange
+	int32_t time_sync(void);
+	// replace the device rule table with rules
+	int32_t load_rules(void);
+	// read the device rule table
+	int32_t fetch_rules(std::vector<struct msg_rule_stat> &table);
+	// print the device rules with their hit counters
+	int32_t read_rules(void);
+	// print the state of every relay
+	void print_relays(const RelayMask &do_mask, uint8_t count);
+	// report an input event received from the device
+	void handle_event(const struct st_msg *msg);
+	// queue the answers carried by a container
+	void handle_container(const struct st_msg *msg);
+	// add the firmware stages of the last frame to the trace
+	void handle_trace(const struct st_msg *msg);
+	// (re)start input sampling at sample_rate, creating the ring file
+	int32_t start_sampling(void);
+	// unpack a batch of input samples into the ring file
+	void handle_samples(const struct st_msg *msg);
+	// print input changes as they are written to a ring file
+	void tail_samples(void);
 };
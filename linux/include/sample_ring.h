@@ -0,0 +1,80 @@
+#ifndef SampleRing_cpp
+#define SampleRing_cpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+//ring file layout:
+//  header:   struct sample_ring_header
+//  marks:    uint64_t[capacity / batch], host time of the first sample of each batch
+//  samples:  uint8_t[capacity], one byte per sample, input n in bit n
+//sample i lives at samples[i % capacity] and was taken at
+//marks[(i / batch) % (capacity / batch)] + (i % batch) * 1e6 / rate us
+#define SAMPLE_RING_MAGIC     "USMP"
+#define SAMPLE_RING_VERSION   1
+#define SAMPLE_RING_FILE      "/dev/shm/arduino_samples"
+//samples kept, rounded down to whole batches
+#define SAMPLE_RING_CAPACITY  (1 << 20)
+//value of the samples of a batch lost on the link
+#define SAMPLE_LOST           0xFF
+
+struct sample_ring_header {
+	char magic[4];
+	uint8_t version;
+	uint8_t inputs;
+	uint16_t batch;               //samples per batch
+	uint32_t rate;                //samples per second
+	uint32_t capacity;            //samples kept
+	std::atomic<uint64_t> head;   //samples written since the file was created
+	std::atomic<uint64_t> lost;   //samples lost on the link
+};
+
+//single writer, any number of readers mapping the same file
+class SampleRing
+{
+public:
+	~SampleRing();
+	//create or replace the ring file
+	int32_t create(const char *filename, uint8_t inputs, uint16_t batch, uint32_t rate);
+	//append one batch of unpacked samples taken from host time host_us
+	void append(const uint8_t *samples, uint64_t host_us);
+	//account for lost batches, filled with SAMPLE_LOST to keep sample times
+	void skip(uint32_t batches, uint64_t host_us);
+	//NULL until created
+	const struct sample_ring_header *info(void) const;
+
+private:
+	struct sample_ring_header *header = NULL;
+	uint64_t *marks = NULL;
+	uint8_t *samples = NULL;
+	size_t size = 0;
+};
+
+class SampleReader
+{
+public:
+	~SampleReader();
+	//map a ring file read-only
+	int32_t open(const char *filename);
+	const struct sample_ring_header *info(void) const;
+	//samples written so far
+	uint64_t head(void) const;
+	//oldest sample that can still be read
+	uint64_t tail(void) const;
+	//contiguous samples from pos, straight from the mapping; count is 0 when
+	//pos has caught up with the writer
+	const uint8_t *peek(uint64_t pos, uint32_t *count) const;
+	//true if the samples from pos read since peek() were not overwritten meanwhile
+	bool intact(uint64_t pos) const;
+	//host time of sample pos in microseconds
+	uint64_t timestamp(uint64_t pos) const;
+
+private:
+	const struct sample_ring_header *header = NULL;
+	const uint64_t *marks = NULL;
+	const uint8_t *samples = NULL;
+	size_t size = 0;
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef SharedState_cpp
+#define SharedState_cpp
+
+#include <stdint.h>
+#include <atomic>
+#include <bitmask.h>
+
+#define SHM_NAME        "/arduino_uart"
+#define SHM_MAGIC       0x55415254
+#define SHM_VERSION     3
+#define SHM_MAX_BOARDS  8
+#define SHM_PORT_LEN    64
+#define SHM_MASK_BYTES  (MAX_CHANNELS / 8)
+//reader attempts before giving up on a writer that died mid-update
+#define SHM_RETRIES     1000
+//a writer holding a slot this long is taken over even if it still exists
+#define SHM_STUCK_NS    1000000000ULL
+
+#define SLOT_FREE       0
+#define SLOT_CLAIMED    1
+#define SLOT_READY      2
+
+//one board, protected by a seqlock: seq is odd while an update is in progress
+struct shm_board {
+	std::atomic<uint32_t> seq;
+	std::atomic<int32_t> writer;       //pid holding the odd count, 0 if not known yet
+	std::atomic<uint32_t> state;
+	char port[SHM_PORT_LEN];
+	std::atomic<uint8_t> do_mask[SHM_MASK_BYTES];
+	std::atomic<uint8_t> channels;
+	std::atomic<uint8_t> link_up;
+	std::atomic<uint64_t> updated_ns;  //CLOCK_MONOTONIC, 0 when invalidated
+};
+
+struct shm_region {
+	std::atomic<uint32_t> magic;
+	uint32_t version;
+	struct shm_board boards[SHM_MAX_BOARDS];
+};
+
+struct relay_snapshot {
+	RelayMask do_mask;
+	uint8_t channels;
+	bool link_up;
+	uint64_t updated_ns;
+};
+
+//host CLOCK_MONOTONIC time in nanoseconds
+uint64_t monotonic_ns(void);
+
+class SharedState
+{
+public:
+	~SharedState();
+	//map the segment and find or claim the slot of a serial port
+	int32_t open(const char *port);
+	//publish the relay state just read from the device
+	void publish(const RelayMask &do_mask, uint8_t channels);
+	//update the link status only
+	void setLink(bool link_up);
+	//mark the snapshot stale, e.g. after a command that changes it
+	void invalidate(void);
+	//consistent copy of the slot, false if never written or the writer is stuck
+	bool read(struct relay_snapshot *snap) const;
+
+private:
+	struct shm_region *region = NULL;
+	struct shm_board *board = NULL;
+	//find or claim the slot of a port, with the segment locked
+	int32_t claim(const char *path);
+	void beginWrite(void);
+	void endWrite(void);
+	//take the slot over from a writer that died or is stuck, true if done
+	bool takeOver(uint64_t waited_ns);
+};
+
+#endif
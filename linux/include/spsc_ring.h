@@ -0,0 +1,82 @@
+#ifndef SpscRing_cpp
+#define SpscRing_cpp
+
+#include <stdint.h>
+#include <atomic>
+
+#define CACHE_LINE  64
+
+//lock-free ring for exactly one producer thread and one consumer thread
+//N must be a power of two
+template <typename T, uint32_t N>
+class SpscRing
+{
+	static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+public:
+	//producer side, false if full
+	bool push(const T &item)
+	{
+		uint32_t head = _head.load(std::memory_order_relaxed);
+		if (head - _tail_cache == N) {
+			_tail_cache = _tail.load(std::memory_order_acquire);
+			if (head - _tail_cache == N) {
+				return false;
+			}
+		}
+		_items[head & (N - 1)] = item;
+		_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	//consumer side, false if empty
+	bool pop(T &item)
+	{
+		uint32_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail == _head_cache) {
+			_head_cache = _head.load(std::memory_order_acquire);
+			if (tail == _head_cache) {
+				return false;
+			}
+		}
+		item = _items[tail & (N - 1)];
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	//consumer side, oldest item without removing it, NULL if empty
+	T *front(void)
+	{
+		uint32_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail == _head_cache) {
+			_head_cache = _head.load(std::memory_order_acquire);
+			if (tail == _head_cache) {
+				return NULL;
+			}
+		}
+		return &_items[tail & (N - 1)];
+	}
+
+	//consumer side, remove the item returned by front()
+	void discard(void)
+	{
+		_tail.store(_tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	//approximate number of queued items, from either side
+	uint32_t size(void) const
+	{
+		return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+	}
+
+private:
+	//producer and consumer indexes on their own cache lines, each with
+	//a private copy of the other side's index to avoid sharing misses
+	alignas(CACHE_LINE) std::atomic<uint32_t> _head{0};
+	uint32_t _tail_cache = 0;
+	alignas(CACHE_LINE) std::atomic<uint32_t> _tail{0};
+	uint32_t _head_cache = 0;
+	alignas(CACHE_LINE) T _items[N];
+};
+
+#endif
@@ -4,27 +4,59 @@
 #include <string.h>     // string function definitions
 #include <unistd.h>     // UNIX standard function definitions
 #include <termios.h>
+#include <string>
+#include "capture.h"
+
+//time allowed for the driver to accept a frame
+#define WRITE_TIMEOUT_MS  1000
 
 class Stream
 {
 public:
+	virtual ~Stream() {}
 	int32_t begin(const char *filename, uint32_t baudrate);
+	// open again the device given to begin()
+	int32_t reopen(void);
+	void close(void);
+	// baud rate given to begin(), 0 if not a serial device
+	uint32_t baudrate(void) const;
+	// false once the device has gone away
+	virtual bool connected(void) const;
+	// log every byte read and written
+	void setCapture(Capture *capture);
 	// write info
-	void write(uint8_t *buffer, uint32_t length);
+	virtual void write(uint8_t *buffer, uint32_t length);
 	void write(uint8_t val);
 	void write(char *str);
 	// write several values
 	// available
-	uint32_t available(void);
+	virtual uint32_t available(void);
 	// read
-	int32_t read(void);
+	virtual int32_t read(void);
+	// wait up to timeout_ms for incoming data
+	virtual bool wait(uint32_t timeout_ms);
+	// going idle: complete the capture record being merged, no syscall
+	void idle(void);
 	// flush
 	int32_t flush(void);
+	// ask the driver to push received bytes without batching (ASYNC_LOW_LATENCY)
+	int32_t setLowLatency(void);
+	// underlying file descriptor
+	int32_t fd(void) const;
+	// wait until everything written has been transmitted (tcdrain)
+	virtual int32_t drain(void);
 private:
 	// serial stream
-	uint32_t _serial_fd;
+	int32_t _serial_fd = -1;
+	std::string _filename;
+	uint32_t _baudrate = 0;
+	bool _connected = false;
 	// options
 	struct termios options;
+	// wire traffic capture
+	Capture *_capture = NULL;
+	// mark the device as gone
+	void linkError(const char *what);
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,65 @@
+#ifndef TimeSync_cpp
+#define TimeSync_cpp
+
+#include <stdint.h>
+
+//number of exchanges kept for the offset/drift fit
+#define SYNC_SAMPLES  16
+//host time the exchanges must span before drift is estimated
+#define SYNC_MIN_SPAN_US  100000
+
+//host CLOCK_MONOTONIC time in microseconds
+uint64_t monotonic_us(void);
+
+class TimeSync
+{
+public:
+	//add one NTP-style exchange
+	//t1: host send, t2: device receive, t3: device send, t4: host receive
+	void addSample(uint64_t t1, uint32_t t2, uint32_t t3, uint64_t t4);
+	//true once at least one exchange has been processed
+	bool valid(void) const;
+	//convert a device micros() timestamp to host monotonic microseconds
+	uint64_t toHost(uint32_t device_us);
+	//estimated device - host offset in microseconds at host time host_us
+	double offset(uint64_t host_us) const;
+	//estimated device clock drift against the host in ppm
+	double drift(void) const;
+	//round trip of the last exchange minus device processing time
+	int64_t lastDelay(void) const;
+	//one-way latencies of the last exchange, using the fitted offset
+	int64_t lastUplink(void) const;
+	int64_t lastDownlink(void) const;
+	//minimum one-way latencies seen so far
+	int64_t minUplink(void) const;
+	int64_t minDownlink(void) const;
+
+private:
+	struct sample {
+		uint64_t host;     //host mid-point of the exchange
+		double offset;     //device - host
+		int64_t delay;     //path delay
+	};
+	struct sample samples[SYNC_SAMPLES];
+	uint32_t n_samples = 0;
+	uint32_t next_sample = 0;
+	//linear model: offset(h) = base + slope * (h - ref)
+	uint64_t ref = 0;
+	double base = 0;
+	double slope = 0;
+	//32-bit micros() unwrapping
+	bool have_device = false;
+	uint64_t last_device = 0;
+	//latency statistics
+	int64_t delay = 0;
+	int64_t uplink = 0;
+	int64_t downlink = 0;
+	int64_t min_uplink = INT64_MAX;
+	int64_t min_downlink = INT64_MAX;
+	//extend a device timestamp to 64 bits around the last seen value
+	uint64_t unwrap(uint32_t device_us);
+	//refit the offset model, weighting low-delay exchanges
+	void fit(void);
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef Trace_cpp
+#define Trace_cpp
+
+#include <stdio.h>
+#include <stdint.h>
+
+//frame lifecycle stages, in the order they normally happen
+#define TRACE_BUILT         0   //request built in outgoingArray
+#define TRACE_ENCODED       1   //dataframe encoded
+#define TRACE_WRITTEN       2   //write() returned
+#define TRACE_DRAINED       3   //tcdrain() returned, the frame left the adapter
+#define TRACE_RX_FIRST      4   //start byte of an answer read
+#define TRACE_RX_CHECKED    5   //answer checksum verified
+#define TRACE_DISPATCHED    6   //answer handed to the waiting command
+//stages measured by the firmware with micros(), in host time
+#define TRACE_DEV_RX_FIRST  7
+#define TRACE_DEV_CHECKED   8
+#define TRACE_DEV_DISPATCHED 9
+#define TRACE_STAGES        10
+
+//marks kept per frame, later ones are dropped
+#define TRACE_MAX_MARKS     64
+
+struct trace_mark {
+	uint64_t ns;    //CLOCK_MONOTONIC
+	uint8_t stage;
+};
+
+//Chrome trace-event JSON (array format), loadable in Perfetto and
+//chrome://tracing. A frame is written out when the next one begins, so the
+//file stays usable if the process is killed.
+class Trace
+{
+public:
+	~Trace();
+	//start recording to filename
+	int32_t open(const char *filename);
+	bool enabled(void) const
+	{
+		return file != NULL;
+	}
+	//a request frame is being sent: marks from now on belong to it
+	void begin(const char *name);
+	//record a stage of the current frame now or at a given time
+	void mark(uint8_t stage)
+	{
+		if (file != NULL) {
+			record(stage, now_ns());
+		}
+	}
+	void mark(uint8_t stage, uint64_t ns)
+	{
+		if (file != NULL) {
+			record(stage, ns);
+		}
+	}
+	//write out the current frame
+	void flush(void);
+
+private:
+	FILE *file = NULL;
+	uint32_t frames = 0;
+	uint32_t events = 0;
+	const char *name = NULL;
+	uint32_t count = 0;
+	struct trace_mark marks[TRACE_MAX_MARKS];
+	static uint64_t now_ns(void);
+	void record(uint8_t stage, uint64_t ns);
+	void event(const char *event_name, uint32_t pid, uint64_t start_ns, uint64_t end_ns);
+};
+
+#endif
@@ -5,11 +5,14 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include "stream.h"
+#include "trace.h"
 
 #define DATA_LEN    40
 #define BUFF_LEN    DATA_LEN * 2
+#define FRAME_LEN   (BUFF_LEN + 4)  //start, length, checksum and end bytes
 #define START_BYTE  0x7E  //dataframe start byte
 #define END_BYTE    0xEF  //dataframe end byte
+#define PACKED_FLAG 0x80  //length byte flag: raw data bytes without message IDs
 
 //incoming serial data/parsing errors
 #define NO_DATA              0
@@ -18,6 +21,7 @@
 #define CHECKSUM_ERROR      -3
 #define TIMEOUT_ERROR       -4
 #define PAYLOAD_ERROR       -5
+#define LINK_ERROR          -6
 
 class UartComms
 {
@@ -28,20 +32,41 @@ public:
 	uint8_t outgoingArray[DATA_LEN] = { 0 };
 	//initialize the UartComms class
 	void begin(Stream& stream);
-	//change the UART buffer timeout (10ms by default)
+	//change the UART buffer timeout (1000ms by default)
 	void setReceiveTimout(uint8_t timeout);
-	//send a selection of data from outgoingArray
-	bool sendData(uint8_t data_len);
-	//update incomingArray with new data if available
+	//send a selection of data from outgoingArray, packed frames leave out the message IDs
+	bool sendData(uint8_t data_len, bool packed = false);
+	//encode a selection of data from outgoingArray into a FRAME_LEN buffer, 0 on error
+	uint32_t encode(uint8_t data_len, uint8_t *frame, bool packed = false);
+	//update incomingArray with new data if available, waiting for the rest of a started dataframe
 	int8_t getData();
+	//consume the bytes already received without waiting, 1 once a whole dataframe is in incomingArray
+	int8_t pollData();
+	//record the lifecycle stages of every frame, NULL to stop
+	void setTrace(Trace *trace);
 
 private:
 	//serial stream
 	Stream* _serial;
-	//receive timeout of 10ms by default
+	//frame lifecycle trace
+	Trace* _trace = NULL;
+	//receive timeout of 1000ms by default
 	uint16_t timeout = 1000;
+	//dataframe being parsed by pollData()
+	uint8_t rxState = 0;
+	uint8_t rxLen = 0;
+	uint8_t rxPos = 0;
+	bool rxPacked = false;
+	uint32_t rxStart = 0;
+	uint8_t rxBuff[BUFF_LEN];
 	//find 8 - bit checksum of message
 	uint8_t calculateChecksum(uint8_t len, uint8_t *buff);
+	//read one byte of the current dataframe with timeout
+	int16_t readByte(uint32_t startTime);
+	//advance the pollData() parser by one byte
+	int8_t feedByte(uint8_t value);
+	//time a whole dataframe takes on the wire, the pollData() timeout
+	uint32_t frameTime(void);
 	//process raw data and stuff into dataArray
 	void processData(uint8_t payloadLen, uint8_t *buff);
 };
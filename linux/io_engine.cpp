@@ -0,0 +1,195 @@
+#include <unistd.h>     // UNIX standard function definitions
+#include <string.h>     // string function definitions
+#include <errno.h>      // Error number definitions
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <iostream>
+#include "io_engine.h"
+#include "timesync.h"
+
+IoEngine::~IoEngine()
+{
+	stop();
+}
+
+int32_t IoEngine::start(Stream &stream, const struct io_options &options)
+{
+	_serial = &stream;
+	opts = options;
+	comms.begin(stream);
+
+	// Frames queued for a device that went away are stale, the client replays
+	// what still matters; the thread is not running so popping here is safe
+	struct io_frame stale;
+	while (tx.pop(stale));
+	// Replies read before the reconnect must not answer the new requests
+	struct io_msg old;
+	while (rx.pop(old));
+	lost = false;
+
+	wake_fd = eventfd(0, EFD_NONBLOCK);
+	if (wake_fd < 0) {
+		std::cerr << "I/O thread cannot be started" << std::endl;
+		return -1;
+	}
+
+	// Page faults on the I/O path would defeat the real-time priority
+	if (opts.mlock && (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)) {
+		std::cerr << "Memory cannot be locked: " << strerror(errno) << std::endl;
+	}
+
+	active = true;
+	thread = std::thread(&IoEngine::run, this);
+	return 0;
+}
+
+void IoEngine::stop(void)
+{
+	if (!active) {
+		return;
+	}
+
+	active = false;
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof(one)) < 0) {
+		std::cerr << "I/O thread wake up failed" << std::endl;
+	}
+	thread.join();
+	close(wake_fd);
+	wake_fd = -1;
+}
+
+bool IoEngine::running(void) const
+{
+	return active;
+}
+
+bool IoEngine::linkLost(void) const
+{
+	return lost;
+}
+
+void IoEngine::setup(void)
+{
+	if (opts.cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(opts.cpu, &set);
+		int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+		if (err != 0) {
+			std::cerr << "I/O thread cannot be pinned to CPU " << opts.cpu << ": " << strerror(err) << std::endl;
+		}
+	}
+
+	if (opts.rt_prio > 0) {
+		struct sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = opts.rt_prio;
+		int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err != 0) {
+			std::cerr << "I/O thread cannot use SCHED_FIFO: " << strerror(err) << std::endl;
+		}
+	}
+}
+
+void IoEngine::run(void)
+{
+	setup();
+
+	struct pollfd pfd[2];
+	pfd[0].fd = _serial->fd();
+	pfd[0].events = POLLIN;
+	pfd[1].fd = wake_fd;
+	pfd[1].events = POLLIN;
+
+	while (active && _serial->connected()) {
+		// Outgoing frames first, they are already encoded
+		struct io_frame *frame;
+		while ((frame = tx.front()) != NULL) {
+			_serial->write(&frame->data[0], frame->length);
+			tx.discard();
+		}
+
+		// Decode everything already received, a dataframe still arriving
+		// is kept for the next pass instead of holding up the TX rings
+		while (true) {
+			int32_t report = comms.pollData();
+			if ((report == NO_DATA) || (report == LINK_ERROR)) {
+				break;
+			}
+			if (report != 1) {
+				continue;
+			}
+			struct io_msg msg;
+			msg.rx_us = monotonic_us();
+			memcpy(&msg.data[0], &comms.incomingArray[0], DATA_LEN);
+			if (!rx.push(msg)) {
+				rx_drops++;
+			}
+		}
+
+		// Sleep until the wire or the application has something
+		pfd[0].revents = 0;
+		pfd[1].revents = 0;
+		_serial->idle();
+		if (poll(pfd, 2, IO_IDLE_MS) > 0 && (pfd[1].revents & POLLIN)) {
+			uint64_t count;
+			if (read(wake_fd, &count, sizeof(count)) < 0) {
+				continue;
+			}
+		}
+	}
+
+	// Let the application thread reconnect
+	if (!_serial->connected()) {
+		lost = true;
+	}
+}
+
+bool IoEngine::send(const struct io_frame &frame)
+{
+	if (!tx.push(frame)) {
+		tx_drops++;
+		return false;
+	}
+
+	// A syscall but no lock: the I/O thread may be sleeping in poll()
+	uint64_t one = 1;
+	return write(wake_fd, &one, sizeof(one)) == sizeof(one);
+}
+
+bool IoEngine::recv(struct io_msg &msg, uint64_t timeout_us)
+{
+	uint64_t start = monotonic_us();
+
+	while (!rx.pop(msg)) {
+		uint64_t waited = monotonic_us() - start;
+		if ((waited >= timeout_us) || lost) {
+			return false;
+		}
+		// Spin first for the lowest latency, then back off
+		if (waited < IO_SPIN_US) {
+			#if defined(__x86_64__) || defined(__i386__)
+				__builtin_ia32_pause();
+			#endif
+		} else {
+			struct timespec ts = { 0, IO_SLEEP_US * 1000 };
+			nanosleep(&ts, NULL);
+		}
+	}
+	return true;
+}
+
+uint64_t IoEngine::rxDrops(void) const
+{
+	return rx_drops;
+}
+
+uint64_t IoEngine::txDrops(void) const
+{
+	return tx_drops;
+}
@@ -1,8 +1,10 @@
 .PHONY: linux-build linux-clean
 
 linux-build:
-	g++ -I linux/include linux/main.cpp linux/linux_client.cpp linux/uart.cpp linux/stream.cpp -o linux_uart
+	g++ -I linux/include -I common linux/main.cpp linux/linux_client.cpp linux/uart.cpp linux/stream.cpp linux/timesync.cpp linux/capture.cpp linux/shm_state.cpp linux/io_engine.cpp linux/hotplug.cpp linux/sample_ring.cpp linux/trace.cpp -o linux_uart -lrt -pthread
+	g++ -I linux/include -I common linux/replay.cpp linux/uart.cpp linux/stream.cpp linux/timesync.cpp linux/capture.cpp linux/trace.cpp -o linux_replay
 
 linux-clean:
 	rm -f *.o
 	rm -f linux_uart
+	rm -f linux_replay
@@ -1,31 +1,187 @@
 #include <unistd.h>     // UNIX standard function definitions
 #include <iostream>
 #include <getopt.h>     // Miscellaneous symbolic constants and types.
+#include <sstream>
 #include "uart.h"
 #include "linux_client.h"
 
 #define BAUDRATE    115200
-#define MAX_DI        4
 
-#define HEADER_MSG    2
-#define MSG_GETSTATS  1
-#define MSG_SETDO     2
-#define MSG_TEST      3
+#define RECV_TIMEOUT_MS  1000
+#define SYNC_PERIOD_MS   1000
+#define BULK_TIMEOUT_MS  200
+#define BULK_RETRIES     5
+#define BULK_WINDOW      4
+#define RECONNECT_MS     30000
+#define RESYNC_TRIES     8
+#define RESYNC_TIMEOUT_MS 250
+//the last rules request is answered once the table is in EEPROM, 3.3 ms a byte
+#define RULES_COMMIT_MS  (RECV_TIMEOUT_MS + (RULES_MAX * msg_rule::size + 4) * 4)
+#define SAMPLE_RESTART_MS 2000
+#define TAIL_POLL_MS     10
+//exchanges run first to place firmware stages on the host clock
+#define TRACE_SYNC_COUNT 4
 
-struct st_msg_do_val {
-	uint8_t do_num;
-	uint8_t do_val;
-};
+static_assert(DATA_LEN == HEADER_MSG + MSG_MAX_PAYLOAD, "frame and message sizes differ");
+static_assert(msg_stats::size + RelayMask::bytes <= MSG_MAX_PAYLOAD, "relay mask does not fit a frame");
 
-struct st_msg_stats {
-	uint8_t do_mask;
-};
+// name of a request in traces
+static const char *msg_name(uint8_t type)
+{
+	switch (type) {
+	case MSG_GETSTATS:
+		return "GETSTATS";
+	case MSG_SETDO:
+		return "SETDO";
+	case MSG_TEST:
+		return "TEST";
+	case MSG_TIMESYNC:
+		return "TIMESYNC";
+	case MSG_BULK:
+		return "BULK";
+	case MSG_MEMSTATS:
+		return "MEMSTATS";
+	case MSG_SAMPLE_CTL:
+		return "SAMPLE_CTL";
+	case MSG_CONTAINER:
+		return "CONTAINER";
+	case MSG_RULES_SET:
+		return "RULES_SET";
+	case MSG_RULES_GET:
+		return "RULES_GET";
+	default:
+		return "unknown";
+	}
+}
 
-struct st_msg {
-	uint8_t type;
-	uint8_t length;
-	uint8_t payload[DATA_LEN-2];
-};
+// edge of a rule from its name, 0 if unknown
+static uint8_t parse_edge(const std::string &name)
+{
+	if (name == "rising") {
+		return EDGE_RISING;
+	} else if (name == "falling") {
+		return EDGE_FALLING;
+	} else if (name == "both") {
+		return EDGE_RISING | EDGE_FALLING;
+	}
+	return 0;
+}
+
+static const char *edge_name(uint8_t edge)
+{
+	switch (edge) {
+	case EDGE_RISING:
+		return "rising";
+	case EDGE_FALLING:
+		return "falling";
+	default:
+		return "both";
+	}
+}
+
+// input or relay numbered from 1, -1 if out of range
+static int32_t parse_channel(const std::string &number)
+{
+	int32_t n = atoi(number.c_str()) - 1;
+	return ((n < 0) || (n >= MAX_CHANNELS)) ? -1 : n;
+}
+
+// rule from its command line form, see usage()
+static bool parse_rule(const char *spec, struct msg_rule &rule)
+{
+	std::vector<std::string> f;
+	std::istringstream in(spec);
+	std::string field;
+	while (std::getline(in, field, ',')) {
+		f.push_back(field);
+	}
+
+	memset(&rule, 0, sizeof(rule));
+	if ((f.size() == 5) && ((f[0] == "edge") || (f[0] == "pulse") || (f[0] == "oneshot"))) {
+		int32_t input = parse_channel(f[1]);
+		int32_t relay = parse_channel(f[3]);
+		rule.edge = parse_edge(f[2]);
+		if ((input < 0) || (relay < 0) || (rule.edge == 0)) {
+			return false;
+		}
+		rule.input = input;
+		rule.relay = relay;
+
+		if (f[0] == "edge") {
+			rule.kind = RULE_EDGE;
+			if (f[4] == "on") {
+				rule.arg = RULE_ON;
+			} else if (f[4] == "off") {
+				rule.arg = RULE_OFF;
+			} else if (f[4] == "toggle") {
+				rule.arg = RULE_TOGGLE;
+			} else {
+				return false;
+			}
+		} else {
+			rule.kind = (f[0] == "pulse") ? RULE_PULSE : RULE_ONESHOT;
+			int32_t ms = atoi(f[4].c_str());
+			if ((ms <= 0) || (ms > UINT16_MAX)) {
+				return false;
+			}
+			rule.arg = ms;
+		}
+		return true;
+	}
+
+	if ((f.size() == 3) && (f[0] == "mutex")) {
+		int32_t group = atoi(f[1].c_str());
+		int32_t relay = parse_channel(f[2]);
+		if ((group < 0) || (group > UINT8_MAX) || (relay < 0)) {
+			return false;
+		}
+		rule.kind = RULE_MUTEX;
+		rule.input = group;
+		rule.relay = relay;
+		return true;
+	}
+
+	if ((f.size() == 3) && (f[0] == "forceoff")) {
+		int32_t source = parse_channel(f[1]);
+		int32_t relay = parse_channel(f[2]);
+		if ((source < 0) || (relay < 0) || (source == relay)) {
+			return false;
+		}
+		rule.kind = RULE_FORCE_OFF;
+		rule.input = source;
+		rule.relay = relay;
+		return true;
+	}
+
+	return false;
+}
+
+// rule in its command line form
+static std::string format_rule(const struct msg_rule_stat &rule)
+{
+	std::ostringstream out;
+	switch (rule.kind) {
+	case RULE_EDGE:
+		out << "edge," << rule.input + 1 << "," << edge_name(rule.edge) << "," << rule.relay + 1 << ","
+		    << ((rule.arg == RULE_TOGGLE) ? "toggle" : ((rule.arg == RULE_ON) ? "on" : "off"));
+		break;
+	case RULE_PULSE:
+	case RULE_ONESHOT:
+		out << ((rule.kind == RULE_PULSE) ? "pulse," : "oneshot,") << rule.input + 1 << ","
+		    << edge_name(rule.edge) << "," << rule.relay + 1 << "," << rule.arg;
+		break;
+	case RULE_MUTEX:
+		out << "mutex," << (uint32_t)rule.input << "," << rule.relay + 1;
+		break;
+	case RULE_FORCE_OFF:
+		out << "forceoff," << rule.input + 1 << "," << rule.relay + 1;
+		break;
+	default:
+		out << "unknown (kind " << (uint32_t)rule.kind << ")";
+		break;
+	}
+	return out.str();
+}
 
 void LinuxClient::usage(FILE *output) const
 {
@@ -34,11 +190,33 @@ void LinuxClient::usage(FILE *output) const
 	        "Usage: linux_uart [OPTIONS]\n"
 	        "\n"
 	        "  -p  --port=DevicePort        Device port\n"
-	        "  -a  --activate               Activate DO [number]\n"
-	        "  -d  --deactivate             Deactivate DO [number]\n"
+	        "  -a  --activate               Activate DO [number], can be repeated\n"
+	        "  -d  --deactivate             Deactivate DO [number], can be repeated\n"
 	        "  -s  --stat=statistics        Get ports state\n"
+	        "  -t  --timesync=count         Synchronize clocks and report latency\n"
+	        "  -w  --watch                  Print input events as they happen\n"
+	        "  -b  --bulk=length            Echo a large payload and report throughput\n"
+	        "  -m  --mem                    Get firmware RAM usage\n"
+	        "  -c  --capture=file           Log wire traffic to a capture file\n"
+	        "  -f  --fresh=ms               Serve -s from shared memory if newer than ms\n"
+	        "  -i  --io-thread              Run serial I/O on a dedicated thread\n"
+	        "  -P  --rt-prio=priority       SCHED_FIFO priority of the I/O thread\n"
+	        "  -C  --cpu=number             Pin the I/O thread to a CPU\n"
+	        "  -L  --mlock                  Lock process memory in RAM\n"
+	        "  -l  --low-latency            Set the driver low latency flag\n"
+	        "  -S  --sample=rate            Stream input samples at rate Hz, 0 stops\n"
+	        "  -R  --ring=file              Sample ring file (default %s)\n"
+	        "  -T  --tail=file              Print input changes from a sample ring file\n"
+	        "  -x  --trace=file             Write frame timings as Chrome trace JSON\n"
+	        "  -r  --rule=spec              Load a device rule, can be repeated, 'none' clears\n"
+	        "                               edge,IN,EDGE,RELAY,on|off|toggle\n"
+	        "                               pulse|oneshot,IN,EDGE,RELAY,ms\n"
+	        "                               mutex,GROUP,RELAY  forceoff,RELAY_A,RELAY_B\n"
+	        "                               EDGE is rising, falling or both\n"
+	        "  -g  --get-rules              Print device rules and their hit counters\n"
 	        "  -h  --help                   Show this help\n"
-	        "\n"
+	        "\n",
+	        SAMPLE_RING_FILE
 	);
 }
 
@@ -55,13 +233,30 @@ int32_t LinuxClient::parse(int32_t argc, char *const argv[])
 			{ "activate",    required_argument, NULL, 'a' },
 			{ "deactivate",  required_argument, NULL, 'd' },
 			{ "stat",        no_argument,       NULL, 's' },
+			{ "timesync",    required_argument, NULL, 't' },
+			{ "watch",       no_argument,       NULL, 'w' },
+			{ "bulk",        required_argument, NULL, 'b' },
+			{ "mem",         no_argument,       NULL, 'm' },
+			{ "capture",     required_argument, NULL, 'c' },
+			{ "fresh",       required_argument, NULL, 'f' },
+			{ "io-thread",   no_argument,       NULL, 'i' },
+			{ "rt-prio",     required_argument, NULL, 'P' },
+			{ "cpu",         required_argument, NULL, 'C' },
+			{ "mlock",       no_argument,       NULL, 'L' },
+			{ "low-latency", no_argument,       NULL, 'l' },
+			{ "sample",      required_argument, NULL, 'S' },
+			{ "ring",        required_argument, NULL, 'R' },
+			{ "tail",        required_argument, NULL, 'T' },
+			{ "trace",       required_argument, NULL, 'x' },
+			{ "rule",        required_argument, NULL, 'r' },
+			{ "get-rules",   no_argument,       NULL, 'g' },
 			{ "help",        no_argument,       NULL, 'h' },
 			{ 0,             0,                 NULL, 0   }
 		};
 
 		int optindex = -1;
 		int c = getopt_long(argc, argv, 
-		                    "p:a:d:sh",
+		                    "p:a:d:st:wb:mc:f:iP:C:LlS:R:T:x:r:gh",
 		                    long_options, &optindex);
 
 		if (c == -1) {
@@ -70,6 +265,8 @@ int32_t LinuxClient::parse(int32_t argc, char *const argv[])
 
 		const char *argument;
 		int32_t aux_do = 0;
+		struct st_msg relay_op;
+		struct msg_do_val do_val;
 		switch (c) {
 		case 'p':
 			argument = optarg;
@@ -84,12 +281,15 @@ int32_t LinuxClient::parse(int32_t argc, char *const argv[])
 				argument++;
 			}
 			aux_do = atoi(argument) - 1;
-			if ((aux_do < 0) || (aux_do >= MAX_DI)) {
+			if ((aux_do < 0) || (aux_do >= MAX_CHANNELS)) {
 				std::cout << "Invalid Relay Number " << aux_do+1 << std::endl;
 				break;
 			}
-			n_do = aux_do;
-			act_do = true;
+			do_val.do_num = aux_do;
+			do_val.do_val = 1;
+			relay_op.type = MSG_SETDO;
+			relay_op.length = do_val.encode(&relay_op.payload[0]);
+			relay_ops.push_back(relay_op);
 			break;
 		case 'd':
 			argument = optarg;
@@ -97,16 +297,132 @@ int32_t LinuxClient::parse(int32_t argc, char *const argv[])
 				argument++;
 			}
 			aux_do = atoi(argument) - 1;
-			if ((aux_do < 0) || (aux_do >= MAX_DI)) {
+			if ((aux_do < 0) || (aux_do >= MAX_CHANNELS)) {
 				std::cout << "Invalid Relay Number " << aux_do+1 << std::endl;
 				break;
 			}
-			n_do = aux_do;
-			deact_do = true;
+			do_val.do_num = aux_do;
+			do_val.do_val = 0;
+			relay_op.type = MSG_SETDO;
+			relay_op.length = do_val.encode(&relay_op.payload[0]);
+			relay_ops.push_back(relay_op);
 			break;
 		case 's':
 			get_stats = true;
 			break;
+		case 't':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			sync_count = atoi(argument);
+			break;
+		case 'w':
+			watch = true;
+			break;
+		case 'b':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			aux_do = atoi(argument);
+			if ((aux_do < 0) || (aux_do > UINT16_MAX)) {
+				std::cout << "Invalid bulk length " << aux_do << std::endl;
+				break;
+			}
+			bulk_len = aux_do;
+			break;
+		case 'm':
+			get_mem = true;
+			break;
+		case 'c':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			capture_file = argument;
+			break;
+		case 'f':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			fresh_ms = atoi(argument);
+			break;
+		case 'i':
+			io_thread = true;
+			break;
+		case 'P':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			io_opts.rt_prio = atoi(argument);
+			break;
+		case 'C':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			io_opts.cpu = atoi(argument);
+			break;
+		case 'L':
+			io_opts.mlock = true;
+			break;
+		case 'l':
+			low_latency = true;
+			break;
+		case 'S':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			aux_do = atoi(argument);
+			if ((aux_do < 0) || (aux_do > UINT16_MAX)) {
+				std::cout << "Invalid sample rate " << aux_do << std::endl;
+				break;
+			}
+			sample_rate = aux_do;
+			break;
+		case 'R':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			ring_file = argument;
+			break;
+		case 'T':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			tail_file = argument;
+			break;
+		case 'x':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			trace_file = argument;
+			break;
+		case 'r':
+			argument = optarg;
+			if (*argument == '=' || *argument == ':') {
+				argument++;
+			}
+			set_rules = true;
+			if (strcmp(argument, "none") != 0) {
+				struct msg_rule rule;
+				if (!parse_rule(argument, rule)) {
+					std::cout << "Invalid rule " << argument << std::endl;
+					return -1;
+				}
+				rules.push_back(rule);
+			}
+			break;
+		case 'g':
+			get_rules = true;
+			break;
 		case 'h':
 			usage(stdout);
 			return 1;
@@ -126,105 +442,1056 @@ int32_t LinuxClient::parse(int32_t argc, char *const argv[])
 
 int32_t LinuxClient::connect(void)
 {
+	// Reading a ring file needs no device
+	if (!tail_file.empty()) {
+		return 0;
+	}
+
+	// Relay state shared with other processes, optional
+	shared.open(dev_port.c_str());
+
+	// A stats request alone can be answered without touching the link
+	bool stats_only = get_stats && relay_ops.empty() && !watch && !get_mem &&
+	                  (sync_count == 0) && (bulk_len == 0) && (sample_rate < 0) &&
+	                  !set_rules && !get_rules;
+	struct relay_snapshot snap;
+	if (stats_only && (fresh_ms > 0) && shared.read(&snap) && snap.link_up &&
+	    (monotonic_ns() - snap.updated_ns <= (uint64_t)fresh_ms * 1000000)) {
+		cached = true;
+		return 0;
+	}
+
+	if (!capture_file.empty()) {
+		if (capture.open(capture_file.c_str()) < 0) {
+			return -1;
+		}
+		serial.setCapture(&capture);
+	}
+
 	if (serial.begin(dev_port.c_str(), BAUDRATE) < 0) {
+		shared.setLink(false);
+		return -1;
+	}
+	UART_comms.begin(serial);
+
+	if (!trace_file.empty()) {
+		if (trace.open(trace_file.c_str()) < 0) {
+			return -1;
+		}
+		UART_comms.setTrace(&trace);
+	}
+	hotplug.watch(dev_port.c_str());
+
+	if (low_latency) {
+		serial.setLowLatency();
+	}
+
+	if (io_thread && (engine.start(serial, io_opts) < 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+bool LinuxClient::send_frame(uint8_t data_len, bool packed)
+{
+	trace.begin(msg_name(UART_comms.outgoingArray[0]));
+
+	// Encoded here, written by the I/O thread
+	if (engine.running()) {
+		struct io_frame frame;
+		frame.length = UART_comms.encode(data_len, &frame.data[0], packed);
+		return (frame.length > 0) && engine.send(frame);
+	}
+
+	return UART_comms.sendData(data_len, packed);
+}
+
+bool LinuxClient::send_msg(uint8_t type, const void *payload, uint8_t length)
+{
+	struct st_msg *msg = (struct st_msg *)(&UART_comms.outgoingArray[0]);
+	if (length > sizeof(msg->payload)) {
+		return false;
+	}
+	msg->type = type;
+	msg->length = length;
+	memcpy(&msg->payload[0], payload, length);
+
+	#if DEBUG_MSG
+		std::cout << "Send Data type: " << (int)msg->type << " length: " << (int)msg->length << std::endl;
+	#endif
+
+	return send_frame(msg->length + HEADER_MSG, false);
+}
+
+bool LinuxClient::send_container(const std::deque<struct st_msg> &msgs)
+{
+	struct st_msg *msg = (struct st_msg *)(&UART_comms.outgoingArray[0]);
+	bool ok = true;
+
+	// Sub-messages back to back, a frame carries as many as fit. Containers
+	// are always packed: without ID bytes small messages take half the wire.
+	msg->type = MSG_CONTAINER;
+	msg->length = 0;
+	for (size_t i = 0; i < msgs.size(); i++) {
+		const struct st_msg *sub = &msgs[i];
+		if (HEADER_MSG + sub->length > MSG_MAX_PAYLOAD) {
+			continue;
+		}
+		if (msg->length + HEADER_MSG + sub->length > MSG_MAX_PAYLOAD) {
+			ok = send_frame(msg->length + HEADER_MSG, true) && ok;
+			msg->type = MSG_CONTAINER;
+			msg->length = 0;
+		}
+
+		memcpy(&msg->payload[msg->length], sub, HEADER_MSG + sub->length);
+		msg->length += HEADER_MSG + sub->length;
+	}
+
+	if (msg->length > 0) {
+		ok = send_frame(msg->length + HEADER_MSG, true) && ok;
+	}
+	return ok;
+}
+
+// Messages the device sends on its own or that need unpacking, by type
+constexpr struct LinuxClient::msg_route LinuxClient::routes[MSG_TYPES] = {
+	{ 0,              NULL },
+	{ MSG_GETSTATS,   NULL },
+	{ MSG_SETDO,      NULL },
+	{ MSG_TEST,       NULL },
+	{ MSG_TIMESYNC,   NULL },
+	{ MSG_EVENT,      &LinuxClient::handle_event },
+	{ MSG_BULK,       NULL },
+	{ MSG_BULK_ACK,   NULL },
+	{ MSG_MEMSTATS,   NULL },
+	{ MSG_SAMPLE_CTL, NULL },
+	{ MSG_SAMPLES,    &LinuxClient::handle_samples },
+	{ MSG_CONTAINER,  &LinuxClient::handle_container },
+	{ MSG_TRACE,      NULL },
+	{ MSG_RULES_SET,  NULL },
+	{ MSG_RULES_GET,  NULL },
+};
+
+void LinuxClient::handle_container(const struct st_msg *msg)
+{
+	// Answers are handled one by one, as if sent separately
+	uint8_t pos = 0;
+	while ((pos + HEADER_MSG <= msg->length) && (msg->length <= MSG_MAX_PAYLOAD)) {
+		struct st_msg sub;
+		sub.type = msg->payload[pos];
+		sub.length = msg->payload[pos + 1];
+		if (pos + HEADER_MSG + sub.length > msg->length) {
+			break;
+		}
+		// Only the bytes of this answer, the frame ends right after the last one
+		memcpy(&sub.payload[0], &msg->payload[pos + HEADER_MSG], sub.length);
+		inbox.push_back(sub);
+		pos += HEADER_MSG + sub.length;
+	}
+}
+
+int32_t LinuxClient::recv_msg(uint8_t type, const struct st_msg **received, uint32_t timeout_ms)
+{
+	uint64_t deadline = monotonic_us() + (uint64_t)timeout_ms * 1000;
+
+	while (true) {
+		int32_t report;
+		const struct st_msg *msg = NULL;
+
+		if (!inbox.empty()) {
+			// Rest of a container, in the order the device answered
+			memcpy(&unpacked, &inbox.front(), HEADER_MSG + inbox.front().length);
+			inbox.pop_front();
+			msg = &unpacked;
+			report = 1;
+		} else if ((engine.running() && engine.linkLost()) || (!engine.running() && !serial.connected())) {
+			// Callers resend whatever they were waiting for
+			if (!reconnecting) {
+				reconnect();
+			}
+			return LINK_ERROR;
+		} else if (engine.running()) {
+			// Already decoded by the I/O thread
+			uint64_t now = monotonic_us();
+			report = NO_DATA;
+			if ((now < deadline) && engine.recv(rx_io, deadline - now)) {
+				msg = (const struct st_msg *)(&rx_io.data[0]);
+				trace.mark(TRACE_RX_CHECKED, rx_io.rx_us * 1000);
+				report = 1;
+			}
+		} else {
+			// Read in place, valid until the next frame
+			report = UART_comms.getData();
+			msg = (const struct st_msg *)(&UART_comms.incomingArray[0]);
+		}
+
+		if (report == 1) {
+			#if DEBUG_MSG
+				std::cout << "msg type: " << (uint32_t)msg->type << ", length: " << (uint32_t)msg->length << std::endl;
+				for (uint32_t i = 0; i < msg->length; i++) {
+					std::cout << i << " -- " << (int)msg->payload[i] << std::endl;
+				}
+			#endif
+
+			if (msg->type == type) {
+				trace.mark(TRACE_DISPATCHED);
+				*received = msg;
+				return 1;
+			}
+			static_assert(routes_in_order(0), "routes must be indexed by message type");
+			msg_handler handler = (msg->type < MSG_TYPES) ? routes[msg->type].handler : NULL;
+			if (handler != NULL) {
+				(this->*handler)(msg);
+			} else {
+				std::cerr << "Not expected msg (type: " << (uint32_t)msg->type << ")" << std::endl;
+			}
+			continue;
+		}
+
+		uint64_t now = monotonic_us();
+		if (now >= deadline) {
+			return 0;
+		}
+		if ((report == NO_DATA) && !engine.running()) {
+			serial.wait((deadline - now + 999) / 1000);
+		}
+	}
+}
+
+int32_t LinuxClient::command(uint8_t type, const void *payload, uint8_t length)
+{
+	struct st_msg cmd;
+	cmd.type = type;
+	cmd.length = length;
+	memcpy(&cmd.payload[0], payload, length);
+	pending.push_back(cmd);
+
+	return flush_pending();
+}
+
+int32_t LinuxClient::flush_pending(void)
+{
+	if (pending.empty()) {
+		return 0;
+	}
+
+	// The firmware stages ride along, answered after everything before them
+	if (trace.enabled() && (pending.back().type != MSG_TRACE)) {
+		struct st_msg stages;
+		stages.type = MSG_TRACE;
+		stages.length = 0;
+		pending.push_back(stages);
+	}
+
+	// A lone command keeps the plain format every firmware understands
+	if (pending.size() == 1) {
+		send_msg(pending.front().type, &pending.front().payload[0], pending.front().length);
+	} else {
+		send_container(pending);
+	}
+
+	// Acknowledged in order, each with the resulting relay state
+	while (!pending.empty()) {
+		const struct st_msg *msg;
+		int32_t report = recv_msg(pending.front().type, &msg, RECV_TIMEOUT_MS);
+		if ((report == 0) && (pending.front().type == MSG_TRACE)) {
+			std::cerr << "Firmware stages not traced, no answer from device" << std::endl;
+			pending.pop_front();
+			continue;
+		}
+		if (report != 1) {
+			// A reconnection replays pending commands
+			return pending.empty() ? 0 : -1;
+		}
+		pending.pop_front();
+		if (msg->type == MSG_TRACE) {
+			handle_trace(msg);
+			continue;
+		}
+		struct msg_stats stats;
+		if (stats.decode(&msg->payload[0], msg->length)) {
+			update_state(stats);
+		}
+	}
+
+	return 0;
+}
+
+void LinuxClient::update_state(const struct msg_stats &stats)
+{
+	have_state = true;
+	channels = (stats.channels < MAX_CHANNELS) ? stats.channels : MAX_CHANNELS;
+	known_mask.load(stats.do_mask.data, stats.do_mask.length);
+	known_ts = stats.timestamp;
+	known_boot = stats.boot;
+	known_rules = stats.rules;
+	shared.publish(known_mask, channels);
+}
+
+int32_t LinuxClient::read_state(void)
+{
+	const struct st_msg *msg;
+	struct msg_stats stats;
+
+	send_msg(MSG_GETSTATS, NULL, 0);
+	if ((recv_msg(MSG_GETSTATS, &msg, RECV_TIMEOUT_MS) != 1) || !stats.decode(&msg->payload[0], msg->length)) {
+		return -1;
+	}
+	update_state(stats);
+	return 0;
+}
+
+int32_t LinuxClient::reconnect(void)
+{
+	reconnecting = true;
+	engine.stop();
+	serial.close();
+	inbox.clear();
+	shared.setLink(false);
+
+	uint64_t start = monotonic_us();
+	std::cerr << "Waiting for " << dev_port << std::endl;
+
+	while (true) {
+		uint64_t waited = (monotonic_us() - start) / 1000;
+		if ((waited >= RECONNECT_MS) || !hotplug.waitPresent(RECONNECT_MS - waited)) {
+			std::cerr << "Device " << dev_port << " did not come back" << std::endl;
+			reconnecting = false;
+			return -1;
+		}
+
+		// The node may exist before it can be opened
+		if (serial.reopen() < 0) {
+			usleep(HOTPLUG_RECHECK_MS * 1000 / 10);
+			continue;
+		}
+		if (low_latency) {
+			serial.setLowLatency();
+		}
+		if (io_thread && (engine.start(serial, io_opts) < 0)) {
+			reconnecting = false;
+			return -1;
+		}
+
+		if (resync() == 0) {
+			break;
+		}
+		// Lost again while resynchronizing
+		engine.stop();
+		serial.close();
+	}
+
+	std::cerr << "Reconnected to " << dev_port << " in " << (monotonic_us() - start) / 1000 << " ms" << std::endl;
+	reconnecting = false;
+	return 0;
+}
+
+int32_t LinuxClient::resync(void)
+{
+	const struct st_msg *msg;
+	int32_t report = 0;
+
+	// Opening the port may have reset the board, give it time to boot
+	for (uint32_t i = 0; (i < RESYNC_TRIES) && (report != 1); i++) {
+		send_msg(MSG_GETSTATS, NULL, 0);
+		report = recv_msg(MSG_GETSTATS, &msg, RESYNC_TIMEOUT_MS);
+		if (report == LINK_ERROR) {
+			return -1;
+		}
+	}
+	if (report != 1) {
+		return -1;
+	}
+
+	struct msg_stats stats;
+	if (!stats.decode(&msg->payload[0], msg->length)) {
+		return -1;
+	}
+
+	// Another boot: the firmware restarted and lost the relay state
+	if (have_state && (stats.boot != known_boot)) {
+		// A relay a pulse switched on must not outlive its timer
+		RelayMask timed;
+		if (stats.rules > 0) {
+			std::vector<struct msg_rule_stat> table;
+			if (fetch_rules(table) < 0) {
+				return -1;
+			}
+			for (size_t i = 0; i < table.size(); i++) {
+				if (((table[i].kind == RULE_PULSE) || (table[i].kind == RULE_ONESHOT)) && (table[i].relay < MAX_CHANNELS)) {
+					timed.set(table[i].relay, true);
+				}
+			}
+		}
+
+		std::deque<struct st_msg> restore;
+		RelayMask reported;
+		uint8_t count = (stats.channels < MAX_CHANNELS) ? stats.channels : MAX_CHANNELS;
+		reported.load(stats.do_mask.data, stats.do_mask.length);
+		for (uint8_t i = 0; i < count; i++) {
+			bool want = known_mask.get(i);
+			if (!timed.get(i) && (reported.get(i) != want)) {
+				struct st_msg cmd;
+				struct msg_do_val val;
+				val.do_num = i;
+				val.do_val = want;
+				cmd.type = MSG_SETDO;
+				cmd.length = val.encode(&cmd.payload[0]);
+				restore.push_back(cmd);
+			}
+		}
+		pending.insert(pending.begin(), restore.begin(), restore.end());
+
+		// The device clock restarted too
+		sync = TimeSync();
+	}
+	update_state(stats);
+
+	// Replay in one go, acknowledged in order
+	return flush_pending();
+}
+
+int32_t LinuxClient::bulk_send(uint8_t type, const uint8_t *data, uint16_t length)
+{
+	struct msg_bulk frag;
+	uint16_t acked = 0;    // everything below has been received by the device
+	uint16_t next = 0;     // next fragment to send
+	uint32_t rewind = UINT32_MAX;
+	uint32_t retries = 0;
+
+	bulk_xfer++;
+	frag.xfer = bulk_xfer;
+	frag.type = type;
+	frag.total = length;
+
+	while (acked < length) {
+		// Keep up to BULK_WINDOW fragments in flight
+		while ((next < length) && (next - acked < BULK_WINDOW * BULK_FRAG)) {
+			uint8_t len = (length - next > BULK_FRAG) ? BULK_FRAG : (length - next);
+			frag.offset = next;
+			frag.data.data = &data[next];
+			frag.data.length = len;
+			send_msg(MSG_BULK, frag);
+			next += len;
+		}
+
+		const struct st_msg *msg;
+		if (recv_msg(MSG_BULK_ACK, &msg, BULK_TIMEOUT_MS) != 1) {
+			// Nothing acknowledged, go back to the first pending fragment
+			if (++retries > BULK_RETRIES) {
+				return -1;
+			}
+			next = acked;
+			continue;
+		}
+
+		struct msg_bulk_ack ack;
+		if (!ack.decode(&msg->payload[0], msg->length) || (ack.xfer != bulk_xfer)) {
+			continue;
+		}
+		switch (ack.status) {
+		case BULK_OK:
+			if (ack.next > acked) {
+				acked = ack.next;
+				retries = 0;
+			}
+			break;
+		case BULK_RETRY:
+			// Every fragment behind a lost one is refused, rewind once per gap
+			if (ack.next != rewind) {
+				rewind = ack.next;
+				acked = ack.next;
+				next = ack.next;
+			}
+			break;
+		default:
+			std::cerr << "Bulk transfer refused (status: " << (uint32_t)ack.status << ")" << std::endl;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int32_t LinuxClient::bulk_recv(uint8_t type, std::vector<uint8_t> &data, uint32_t timeout_ms)
+{
+	int32_t xfer = -1;
+	uint16_t total = 0;
+
+	data.clear();
+	do {
+		const struct st_msg *msg;
+		if (recv_msg(MSG_BULK, &msg, timeout_ms) != 1) {
+			return 0;
+		}
+
+		struct msg_bulk frag;
+		if (!frag.decode(&msg->payload[0], msg->length) || (frag.type != type)) {
+			continue;
+		}
+		uint8_t len = frag.data.length;
+
+		if (frag.offset == 0) {
+			xfer = frag.xfer;
+			total = frag.total;
+			data.clear();
+			data.reserve(total);
+		}
+		if ((frag.xfer != xfer) || (frag.offset != data.size()) || (data.size() + len > total)) {
+			std::cerr << "Bulk fragment lost at offset " << data.size() << std::endl;
+			return -1;
+		}
+		data.insert(data.end(), frag.data.data, frag.data.data + len);
+	} while (data.size() < total);
+
+	return 1;
+}
+
+int32_t LinuxClient::time_sync(void)
+{
+	struct msg_timesync req;
+	memset(&req, 0, sizeof(req));
+
+	uint64_t t1 = monotonic_us();
+	req.t1 = (uint32_t)t1;
+	send_msg(MSG_TIMESYNC, req);
+
+	const struct st_msg *msg;
+	if (recv_msg(MSG_TIMESYNC, &msg, RECV_TIMEOUT_MS) != 1) {
 		return -1;
 	}
+	uint64_t t4 = monotonic_us();
+
+	struct msg_timesync reply;
+	if (!reply.decode(&msg->payload[0], msg->length) || (reply.t1 != (uint32_t)t1)) {
+		// Answer to an older request
+		return -1;
+	}
+
+	sync.addSample(t1, reply.t2, reply.t3, t4);
 	return 0;
 }
 
+int32_t LinuxClient::load_rules(void)
+{
+	if (rules.size() > RULES_MAX) {
+		std::cerr << "At most " << RULES_MAX << " rules fit in the device" << std::endl;
+		return -1;
+	}
+
+	uint8_t data[RULES_MAX * msg_rule::size];
+	for (size_t i = 0; i < rules.size(); i++) {
+		rules[i].encode(&data[i * msg_rule::size]);
+	}
+
+	// A long table takes several frames, the device switches to it after the last
+	uint8_t first = 0;
+	do {
+		uint8_t n = (rules.size() - first > RULES_PER_SET) ? RULES_PER_SET : (rules.size() - first);
+		struct msg_rules req;
+		req.first = first;
+		req.count = rules.size();
+		req.data.data = &data[first * msg_rule::size];
+		req.data.length = n * msg_rule::size;
+		send_msg(MSG_RULES_SET, req);
+
+		const struct st_msg *msg;
+		struct msg_rules_ack ack;
+		uint32_t timeout = (first + n == rules.size()) ? RULES_COMMIT_MS : RECV_TIMEOUT_MS;
+		if ((recv_msg(MSG_RULES_SET, &msg, timeout) != 1) || !ack.decode(&msg->payload[0], msg->length)) {
+			std::cerr << "No answer from device" << std::endl;
+			return -1;
+		}
+		if (ack.status == RULES_INVALID) {
+			std::cerr << "Rule " << (uint32_t)ack.next + 1 << " refused by the device" << std::endl;
+			return -1;
+		}
+		if ((ack.status != RULES_OK) || (ack.next != first + n)) {
+			std::cerr << "Rules not stored (status: " << (uint32_t)ack.status << ")" << std::endl;
+			return -1;
+		}
+		first += n;
+	} while (first < rules.size());
+
+	// Relays now follow the new table, the state is read again when needed
+	have_state = false;
+	std::cout << "Rules stored: " << rules.size() << std::endl;
+	return 0;
+}
+
+int32_t LinuxClient::fetch_rules(std::vector<struct msg_rule_stat> &table)
+{
+	uint8_t first = 0;
+	uint8_t count = 0;
+
+	table.clear();
+	do {
+		struct msg_rules_get req;
+		req.first = first;
+		send_msg(MSG_RULES_GET, req);
+
+		const struct st_msg *msg;
+		struct msg_rules reply;
+		if ((recv_msg(MSG_RULES_GET, &msg, RECV_TIMEOUT_MS) != 1) || !reply.decode(&msg->payload[0], msg->length) ||
+		    (reply.first != first)) {
+			return -1;
+		}
+		count = reply.count;
+
+		uint8_t start = first;
+		for (uint8_t pos = 0; (pos + msg_rule_stat::size <= reply.data.length) && (first < count); pos += msg_rule_stat::size) {
+			struct msg_rule_stat stat;
+			stat.decode(&reply.data.data[pos], msg_rule_stat::size);
+			table.push_back(stat);
+			first++;
+		}
+		if (first == start) {
+			break;
+		}
+	} while (first < count);
+
+	return 0;
+}
+
+int32_t LinuxClient::read_rules(void)
+{
+	std::vector<struct msg_rule_stat> table;
+	if (fetch_rules(table) < 0) {
+		std::cerr << "No answer from device" << std::endl;
+		return -1;
+	}
+
+	for (size_t i = 0; i < table.size(); i++) {
+		std::cout << "Rule " << i + 1 << ": " << format_rule(table[i]) << ", hits " << table[i].hits << std::endl;
+	}
+	if (table.empty()) {
+		std::cout << "No rules" << std::endl;
+	}
+	return 0;
+}
+
+void LinuxClient::print_relays(const RelayMask &do_mask, uint8_t count)
+{
+	for (uint8_t i = 0; i < count; i++) {
+		std::cout << "Relay " << (int)(i+1) << ": " << (int)do_mask.get(i) << std::endl;
+	}
+}
+
+void LinuxClient::handle_trace(const struct st_msg *msg)
+{
+	struct msg_trace stages;
+
+	// Firmware times can only be placed with a clock model
+	if (!stages.decode(&msg->payload[0], msg->length) || !sync.valid()) {
+		return;
+	}
+	trace.mark(TRACE_DEV_RX_FIRST, sync.toHost(stages.rx_first) * 1000);
+	trace.mark(TRACE_DEV_CHECKED, sync.toHost(stages.rx_checked) * 1000);
+	trace.mark(TRACE_DEV_DISPATCHED, sync.toHost(stages.dispatched) * 1000);
+}
+
+void LinuxClient::handle_event(const struct st_msg *msg)
+{
+	struct msg_event event;
+	if (!event.decode(&msg->payload[0], msg->length)) {
+		return;
+	}
+
+	// Rules switch relays with or without an event, the state has to be
+	// read again; without rules buttons toggle relays on their rising edge
+	if (known_rules > 0) {
+		shared.invalidate();
+		have_state = false;
+	} else if (event.edge == EDGE_RISING) {
+		shared.invalidate();
+		if (have_state && (event.di_num < channels)) {
+			known_mask.toggle(event.di_num);
+			known_ts = event.timestamp;
+		}
+	}
+
+	if (!watch) {
+		return;
+	}
+
+	std::cout << "DI " << (int)(event.di_num + 1) << ": "
+	          << ((event.edge == EDGE_RISING) ? "rising" : "falling")
+	          << " device " << event.timestamp << " us";
+	if (sync.valid()) {
+		uint64_t host_ts = sync.toHost(event.timestamp);
+		std::cout << " host " << host_ts << " us"
+		          << " (" << (int64_t)(monotonic_us() - host_ts) << " us ago)";
+	}
+	std::cout << std::endl;
+}
+
+int32_t LinuxClient::start_sampling(void)
+{
+	struct msg_sample_ctl req;
+	memset(&req, 0, sizeof(req));
+	req.rate = (uint16_t)sample_rate;
+
+	const struct st_msg *msg;
+	send_msg(MSG_SAMPLE_CTL, req);
+	if (recv_msg(MSG_SAMPLE_CTL, &msg, RECV_TIMEOUT_MS) != 1) {
+		return -1;
+	}
+
+	// Batch numbers start over with every stream
+	have_seq = false;
+	last_batch_us = monotonic_us();
+
+	struct msg_sample_ctl reply;
+	if (!reply.decode(&msg->payload[0], msg->length)) {
+		return -1;
+	}
+	if (reply.rate == 0) {
+		// Stopped as asked, or refused
+		return (sample_rate == 0) ? 0 : -1;
+	}
+	if (samples.info() != NULL) {
+		return 0;
+	}
+	if (reply.batch * SAMPLE_BITS > SAMPLES_DATA * 8) {
+		std::cerr << "Invalid sample batch of " << (uint32_t)reply.batch << std::endl;
+		return -1;
+	}
+	if (samples.create(ring_file.c_str(), reply.inputs, reply.batch, reply.rate) < 0) {
+		return -1;
+	}
+
+	std::cout << "Sampling " << (uint32_t)reply.inputs << " inputs at " << reply.rate
+	          << " Hz into " << ring_file << std::endl;
+	return 0;
+}
+
+void LinuxClient::handle_samples(const struct st_msg *msg)
+{
+	const struct sample_ring_header *ring = samples.info();
+	struct msg_samples batch;
+
+	if ((ring == NULL) || !batch.decode(&msg->payload[0], msg->length)) {
+		return;
+	}
+
+	uint64_t now = monotonic_us();
+	uint64_t host_us;
+	if (sync.valid()) {
+		host_us = sync.toHost(batch.timestamp);
+	} else {
+		// Best guess: the batch was sent as soon as it was complete
+		host_us = now - (uint64_t)ring->batch * 1000000 / ring->rate;
+	}
+
+	// Missing batch numbers were dropped by the device or lost on the link
+	if (have_seq) {
+		uint16_t gap = batch.seq - next_seq;
+		if (gap >= 0x8000) {
+			// Late duplicate
+			return;
+		}
+		if (gap > 0) {
+			std::cerr << "Lost " << (uint32_t)gap * ring->batch << " samples" << std::endl;
+			samples.skip(gap, host_us);
+		}
+	}
+	have_seq = true;
+	next_seq = batch.seq + 1;
+	last_batch_us = now;
+
+	uint8_t unpacked[SAMPLES_DATA * 8 / SAMPLE_BITS];
+	for (uint32_t i = 0; i < ring->batch; i++) {
+		unpacked[i] = (batch.data.data[i / 2] >> ((i % 2) * SAMPLE_BITS)) & ((1 << SAMPLE_BITS) - 1);
+	}
+	samples.append(unpacked, host_us);
+}
+
+void LinuxClient::tail_samples(void)
+{
+	SampleReader reader;
+	if (reader.open(tail_file.c_str()) < 0) {
+		return;
+	}
+
+	const struct sample_ring_header *ring = reader.info();
+	std::cout << (uint32_t)ring->inputs << " inputs at " << ring->rate << " Hz" << std::endl;
+
+	// Follow the writer from now on
+	uint64_t pos = reader.head();
+	int32_t prev = -1;
+	std::vector<uint64_t> changes;
+
+	while (true) {
+		uint32_t count;
+		const uint8_t *data = reader.peek(pos, &count);
+		if (count == 0) {
+			usleep(TAIL_POLL_MS * 1000);
+			continue;
+		}
+
+		// Scan the mapping in place, then make sure the writer did not lap us
+		changes.clear();
+		int32_t last = prev;
+		for (uint32_t i = 0; i < count; i++) {
+			if (data[i] != last) {
+				last = data[i];
+				changes.push_back(pos + i);
+			}
+		}
+		if (!reader.intact(pos)) {
+			uint64_t tail = reader.tail();
+			std::cerr << "Reader too slow, skipped " << (tail - pos) << " samples" << std::endl;
+			pos = tail;
+			prev = -1;
+			continue;
+		}
+
+		for (size_t i = 0; i < changes.size(); i++) {
+			uint64_t at = changes[i];
+			uint8_t value = data[at - pos];
+			std::cout << reader.timestamp(at) << " us sample " << at << ": ";
+			if (value == SAMPLE_LOST) {
+				std::cout << "lost";
+			} else {
+				for (int32_t in = ring->inputs - 1; in >= 0; in--) {
+					std::cout << ((value >> in) & 1);
+				}
+			}
+			std::cout << std::endl;
+		}
+		prev = last;
+		pos += count;
+	}
+}
+
 void LinuxClient::exec(void)
 {
-	UartComms UART_comms;
-	UART_comms.begin(serial);
+	if (!tail_file.empty()) {
+		tail_samples();
+		return;
+	}
 
-	if (act_do || deact_do) {
-		struct st_msg *msg = (struct st_msg *)(&UART_comms.outgoingArray[0]);
-		msg->type = MSG_SETDO;
-		msg->length = sizeof(struct st_msg_do_val);
+	if (cached) {
+		struct relay_snapshot snap;
+		if (shared.read(&snap)) {
+			print_relays(snap.do_mask, snap.channels);
+			std::cout << "Updated: " << (monotonic_ns() - snap.updated_ns) / 1000 << " us ago (shared memory)" << std::endl;
+		}
+		return;
+	}
 
-		struct st_msg_do_val *payload = (struct st_msg_do_val *)(&msg->payload[0]);
+	if (trace.enabled()) {
+		for (uint32_t i = 0; i < TRACE_SYNC_COUNT; i++) {
+			time_sync();
+		}
+	}
 
-		payload->do_num = (uint8_t)n_do;
-		payload->do_val = (uint8_t)(act_do && !deact_do);
+	// Interlocks first, so that they already apply to the relay commands
+	if (set_rules && (load_rules() < 0)) {
+		return;
+	}
+
+	bool stats_known = false;
+	if (!relay_ops.empty()) {
+		pending.insert(pending.end(), relay_ops.begin(), relay_ops.end());
 
-		UART_comms.sendData(msg->length + HEADER_MSG);
+		// The state is read back in the same container as the commands
+		if (get_stats) {
+			struct st_msg poll;
+			poll.type = MSG_GETSTATS;
+			poll.length = 0;
+			pending.push_back(poll);
+		}
 
-		#if DEBUG_MSG
-			std::cout << "Send Data type: " << (int)msg->type << " length: " << (int)msg->length << std::endl;
-			std::cout << "do_num " << (int)payload->do_num << " val: " << (int)payload->do_val << std::endl;
-		#endif
+		if (flush_pending() < 0) {
+			std::cerr << "Relay command not acknowledged" << std::endl;
+		} else {
+			stats_known = get_stats;
+			// The device ignores relays it does not have
+			for (size_t i = 0; i < relay_ops.size(); i++) {
+				struct msg_do_val op;
+				if (op.decode(&relay_ops[i].payload[0], relay_ops[i].length) && (op.do_num >= channels)) {
+					std::cerr << "Relay " << (int)(op.do_num + 1) << " is not on this board" << std::endl;
+				}
+			}
+		}
 	}
 
 	#if TEST
 		/* Request of TEST */
 		{
-			struct st_msg *msg = (struct st_msg *)(&UART_comms.outgoingArray[0]);
-			msg->type = MSG_TEST;
-			msg->length = 0;
-			for (uint32_t i = 0; i < 10; i++) {
-				msg->payload[msg->length++] = i+20;
+			uint8_t payload[10];
+			for (uint32_t i = 0; i < sizeof(payload); i++) {
+				payload[i] = i+20;
 			}
-			UART_comms.sendData(msg->length + HEADER_MSG);
-			#if DEBUG_MSG
-				std::cout << "Send Data type: " << (int)msg->type << " length: " << (int)msg->length << std::endl;
-			#endif
+			send_msg(MSG_TEST, payload, sizeof(payload));
 		}
 		/* Read Test */
 		{
-			while (true) {
-				int32_t report = UART_comms.getData();
-
-				if (report == 1) {
-					struct st_msg msg;
-					memcpy(&msg, &UART_comms.incomingArray[0], sizeof(struct st_msg));
-
-					std::cout << "msg type: " << (uint32_t)msg.type << ", length: " << (uint32_t)msg.length << std::endl;
-					for (uint32_t i = 0; i < msg.length; i++) {
-						std::cout << i << " -- " << (int)msg.payload[i] << std::endl;
-					}
-					break;
+			const struct st_msg *msg;
+			if (recv_msg(MSG_TEST, &msg, RECV_TIMEOUT_MS) == 1) {
+				std::cout << "msg type: " << (uint32_t)msg->type << ", length: " << (uint32_t)msg->length << std::endl;
+				for (uint32_t i = 0; i < msg->length; i++) {
+					std::cout << i << " -- " << (int)msg->payload[i] << std::endl;
 				}
 			}
 		}
 	#endif
 
+	if (bulk_len > 0) {
+		std::vector<uint8_t> data(bulk_len);
+		for (uint32_t i = 0; i < bulk_len; i++) {
+			data[i] = (uint8_t)(i * 7 + 1);
+		}
+
+		uint64_t start = monotonic_us();
+		if (bulk_send(MSG_TEST, &data[0], bulk_len) < 0) {
+			std::cerr << "Bulk transfer failed" << std::endl;
+		} else {
+			uint64_t sent = monotonic_us();
+			std::vector<uint8_t> echo;
+			if (bulk_recv(MSG_TEST, echo, RECV_TIMEOUT_MS) != 1) {
+				std::cerr << "Bulk echo failed" << std::endl;
+			} else {
+				uint64_t done = monotonic_us();
+				std::cout << "Bulk " << bulk_len << " bytes: "
+				          << ((echo == data) ? "OK" : "MISMATCH") << std::endl;
+				std::cout << "Upload: " << (sent - start) << " us ("
+				          << (uint64_t)bulk_len * 1000000 / (sent - start) << " B/s)" << std::endl;
+				std::cout << "Echo: " << (done - sent) << " us ("
+				          << (uint64_t)bulk_len * 1000000 / (done - sent) << " B/s)" << std::endl;
+			}
+		}
+	}
+
+	if (sync_count > 0) {
+		uint32_t ok = 0;
+		for (uint32_t i = 0; i < sync_count; i++) {
+			if (time_sync() == 0) {
+				ok++;
+			}
+		}
+
+		if (!sync.valid()) {
+			std::cerr << "Time synchronization failed" << std::endl;
+		} else {
+			std::cout << "Exchanges: " << ok << "/" << sync_count << std::endl;
+			std::cout << "Offset: " << (int64_t)sync.offset(monotonic_us()) << " us" << std::endl;
+			std::cout << "Drift: " << sync.drift() << " ppm" << std::endl;
+			std::cout << "Delay: " << sync.lastDelay() << " us" << std::endl;
+			std::cout << "Uplink: " << sync.lastUplink() << " us (min " << sync.minUplink() << " us)" << std::endl;
+			std::cout << "Downlink: " << sync.lastDownlink() << " us (min " << sync.minDownlink() << " us)" << std::endl;
+		}
+	}
+
 	if (get_stats) {
-		/* Request of statistics */
-		{
-			struct st_msg *msg = (struct st_msg *)(&UART_comms.outgoingArray[0]);
-			msg->type = MSG_GETSTATS;
-			msg->length = 0;
+		const struct st_msg *msg;
+		int32_t report = 1;
 
-			UART_comms.sendData(msg->length + HEADER_MSG);
-			#if DEBUG_MSG
-				std::cout << "Send Data type: " << (int)msg->type << " length: " << (int)msg->length << std::endl;
-			#endif
+		/* Request of statistics, again if the link was reset meanwhile */
+		if (!stats_known) {
+			do {
+				send_msg(MSG_GETSTATS, NULL, 0);
+				report = recv_msg(MSG_GETSTATS, &msg, RECV_TIMEOUT_MS);
+			} while ((report == LINK_ERROR) && serial.connected());
+
+			struct msg_stats stats;
+			if ((report == 1) && stats.decode(&msg->payload[0], msg->length)) {
+				update_state(stats);
+			}
 		}
 
 		/* Read answer */
+		if (report != 1) {
+			std::cerr << "No answer from device" << std::endl;
+			shared.setLink(false);
+		} else {
+			print_relays(known_mask, channels);
+			std::cout << "Timestamp: " << known_ts << " us";
+			if (sync.valid()) {
+				std::cout << " (host " << sync.toHost(known_ts) << " us)";
+			}
+			std::cout << std::endl;
+		}
+	}
+
+	if (get_rules) {
+		read_rules();
+	}
+
+	if (get_mem) {
+		send_msg(MSG_MEMSTATS, NULL, 0);
+
+		const struct st_msg *msg;
+		struct msg_memstats mem;
+		if ((recv_msg(MSG_MEMSTATS, &msg, RECV_TIMEOUT_MS) != 1) || !mem.decode(&msg->payload[0], msg->length)) {
+			std::cerr << "No answer from device" << std::endl;
+		} else {
+			std::cout << "Static RAM: " << mem.static_ram << " bytes" << std::endl;
+			std::cout << "Free RAM: " << mem.free_ram << " bytes" << std::endl;
+			std::cout << "Stack high-water: " << mem.stack_max << " bytes" << std::endl;
+			std::cout << "Sample batches deferred: " << mem.samples_deferred << ", max wait " << mem.samples_wait << " us" << std::endl;
+			std::cout << "Bulk fragments deferred: " << mem.bulk_deferred << ", max wait " << mem.bulk_wait << " us" << std::endl;
+		}
+	}
+
+	if (engine.running() && (engine.rxDrops() || engine.txDrops())) {
+		std::cerr << "I/O rings full: " << engine.rxDrops() << " received and "
+		          << engine.txDrops() << " outgoing frames dropped" << std::endl;
+	}
+
+	if (sample_rate == 0) {
+		if (start_sampling() < 0) {
+			std::cerr << "No answer from device" << std::endl;
+		}
+	} else if (sample_rate > 0) {
+		if (start_sampling() < 0) {
+			std::cerr << "Sampling cannot be started" << std::endl;
+			return;
+		}
+
+		uint64_t next_sync = 0;
 		while (true) {
-			int32_t report = UART_comms.getData();
-
-			if (report == 1) {
-				struct st_msg msg;
-				memcpy(&msg, &UART_comms.incomingArray[0], sizeof(struct st_msg));
-
-				#if DEBUG_MSG
-					std::cout << "msg type: " << (uint32_t)msg.type << ", length: " << (uint32_t)msg.length << std::endl;
-					for (uint32_t i = 0; i < msg.length; i++) {
-						std::cout << i << " -- " << (int)msg.payload[i] << std::endl;
-					}
-				#endif
-
-				if (msg.type != MSG_GETSTATS) {
-					std::cerr << "Not expected msg (type: " << (uint32_t)msg.type << ")" << std::endl;
-				} else {
-					struct st_msg_stats *msg_stats = (struct st_msg_stats *)(&msg.payload[0]);
-					for (uint8_t i = 0; i < MAX_DI; i++) {
-						std::cout << "Relay " << (int)(i+1) << ": " << (int)((msg_stats->do_mask & (1 << i)) > 0) << std::endl;
-					}
-				}
-				break;
+			// Batch times are converted with the clock model
+			if (monotonic_us() >= next_sync) {
+				time_sync();
+				next_sync = monotonic_us() + (uint64_t)SYNC_PERIOD_MS * 1000;
+			}
+			const struct st_msg *msg;
+			if (recv_msg(MSG_SAMPLES, &msg, SYNC_PERIOD_MS) == 1) {
+				handle_samples(msg);
+			}
+			// A board that restarted has forgotten the stream
+			const struct sample_ring_header *ring = samples.info();
+			uint64_t quiet_us = (uint64_t)SAMPLE_RESTART_MS * 1000;
+			if ((ring != NULL) && (ring->rate > 0)) {
+				quiet_us += (uint64_t)ring->batch * 2000000 / ring->rate;
+			}
+			if (monotonic_us() - last_batch_us > quiet_us) {
+				start_sampling();
+			}
+		}
+	}
+
+	if (watch) {
+		// Relay state to restore if the board restarts while watching
+		if (!have_state) {
+			read_state();
+		}
+
+		uint64_t next_sync = 0;
+		while (true) {
+			// Keep offset and drift estimate up to date
+			if (monotonic_us() >= next_sync) {
+				time_sync();
+				next_sync = monotonic_us() + (uint64_t)SYNC_PERIOD_MS * 1000;
+			}
+			const struct st_msg *msg;
+			if (recv_msg(MSG_EVENT, &msg, SYNC_PERIOD_MS) == 1) {
+				handle_event(msg);
+			}
+			if (!have_state) {
+				read_state();
 			}
 		}
 	}
@@ -0,0 +1,291 @@
+#include <stdio.h>      // standard input / output functions
+#include <stdlib.h>
+#include <getopt.h>     // Miscellaneous symbolic constants and types.
+#include <time.h>
+#include <vector>
+#include <iostream>
+#include "uart.h"
+#include "capture.h"
+#include "timesync.h"
+
+#define GAP_MS        100
+
+// Serves one direction of a capture to UartComms, straight from the mapping
+class ReplayStream : public Stream
+{
+public:
+	void add(const struct capture_record *rec);
+	// start serving, in real time from host time start_us if realtime
+	void start(uint64_t first_us, uint64_t start_us, bool realtime);
+	// capture time of the next byte, UINT64_MAX when exhausted
+	uint64_t next(void) const;
+	// capture time of the last byte read
+	uint64_t timestamp(void) const;
+	uint32_t available(void);
+	int32_t read(void);
+	bool wait(uint32_t timeout_ms);
+	void write(uint8_t *, uint32_t) {}
+	bool connected(void) const { return true; }
+
+private:
+	struct segment {
+		uint64_t ts_us;
+		const uint8_t *data;
+		uint32_t length;
+	};
+	std::vector<struct segment> segments;
+	size_t seg = 0;
+	uint32_t pos = 0;
+	uint64_t last_ts = 0;
+	uint64_t shift = 0;
+	bool realtime = false;
+	bool due(void) const;
+};
+
+void ReplayStream::add(const struct capture_record *rec)
+{
+	struct segment s = { rec->ts_us, rec->data, rec->length };
+	if (s.length > 0) {
+		segments.push_back(s);
+	}
+}
+
+void ReplayStream::start(uint64_t first_us, uint64_t start_us, bool _realtime)
+{
+	realtime = _realtime;
+	shift = start_us - first_us;
+	seg = 0;
+	pos = 0;
+}
+
+uint64_t ReplayStream::next(void) const
+{
+	return (seg < segments.size()) ? segments[seg].ts_us : UINT64_MAX;
+}
+
+uint64_t ReplayStream::timestamp(void) const
+{
+	return last_ts;
+}
+
+bool ReplayStream::due(void) const
+{
+	if (seg >= segments.size()) {
+		return false;
+	}
+	return !realtime || (segments[seg].ts_us + shift <= monotonic_us());
+}
+
+uint32_t ReplayStream::available(void)
+{
+	return due() ? (segments[seg].length - pos) : 0;
+}
+
+int32_t ReplayStream::read(void)
+{
+	if (!due()) {
+		return -1;
+	}
+
+	const struct segment *s = &segments[seg];
+	int32_t value = s->data[pos++];
+	last_ts = s->ts_us;
+	if (pos == s->length) {
+		seg++;
+		pos = 0;
+	}
+	return value;
+}
+
+bool ReplayStream::wait(uint32_t timeout_ms)
+{
+	if (seg >= segments.size()) {
+		return false;
+	}
+	if (!realtime) {
+		return true;
+	}
+
+	uint64_t now = monotonic_us();
+	uint64_t at = segments[seg].ts_us + shift;
+	if (at > now) {
+		uint64_t delay = at - now;
+		if (delay > (uint64_t)timeout_ms * 1000) {
+			delay = (uint64_t)timeout_ms * 1000;
+		}
+		struct timespec ts = { (time_t)(delay / 1000000), (long)(delay % 1000000) * 1000 };
+		nanosleep(&ts, NULL);
+	}
+	return due();
+}
+
+static const char *error_name(int32_t report)
+{
+	switch (report) {
+	case SERIAL_BUFF_ERROR: return "garbage";
+	case END_BYTE_ERROR:    return "end byte";
+	case CHECKSUM_ERROR:    return "checksum";
+	case TIMEOUT_ERROR:     return "timeout";
+	case PAYLOAD_ERROR:     return "payload length";
+	case LINK_ERROR:        return "link lost";
+	default:                return "unknown";
+	}
+}
+
+static void usage(FILE *output)
+{
+	fprintf(output,
+	        "\n"
+	        "Usage: linux_replay [OPTIONS] capture\n"
+	        "\n"
+	        "  -r  --realtime               Replay with the captured timing\n"
+	        "  -g  --gap=ms                 Report silences longer than ms (default %d)\n"
+	        "  -q  --quiet                  Only print the summary\n"
+	        "  -h  --help                   Show this help\n"
+	        "\n",
+	        GAP_MS
+	);
+}
+
+int main(int argc, char** argv)
+{
+	bool realtime = false;
+	bool quiet = false;
+	uint32_t gap_ms = GAP_MS;
+
+	while (true) {
+		const static struct option long_options[] = {
+			{ "realtime",    no_argument,       NULL, 'r' },
+			{ "gap",         required_argument, NULL, 'g' },
+			{ "quiet",       no_argument,       NULL, 'q' },
+			{ "help",        no_argument,       NULL, 'h' },
+			{ 0,             0,                 NULL, 0   }
+		};
+
+		int optindex = -1;
+		int c = getopt_long(argc, argv, "rg:qh", long_options, &optindex);
+		if (c == -1) {
+			break;
+		}
+
+		switch (c) {
+		case 'r':
+			realtime = true;
+			break;
+		case 'g':
+			gap_ms = atoi(optarg);
+			break;
+		case 'q':
+			quiet = true;
+			break;
+		case 'h':
+			usage(stdout);
+			return 0;
+		default:
+			usage(stderr);
+			return -1;
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(stderr);
+		return -1;
+	}
+
+	CaptureReader reader;
+	if (reader.open(argv[optind]) < 0) {
+		return -1;
+	}
+
+	/* Split directions and look for silences */
+	ReplayStream streams[2];
+	uint64_t bytes[2] = { 0, 0 };
+	uint64_t first_us = 0;
+	uint64_t prev_us = 0;
+	uint32_t sessions = 0;
+	uint32_t gaps = 0;
+	struct capture_record rec;
+
+	while (reader.next(&rec)) {
+		if (rec.dir == CAPTURE_SESSION) {
+			if (sessions++ == 0) {
+				first_us = rec.ts_us;
+			}
+			prev_us = rec.ts_us;
+			continue;
+		}
+
+		if (rec.ts_us - prev_us > (uint64_t)gap_ms * 1000) {
+			gaps++;
+			if (!quiet) {
+				printf("[%12.6f] gap of %.3f ms\n", (rec.ts_us - first_us) / 1e6, (rec.ts_us - prev_us) / 1e3);
+			}
+		}
+		prev_us = rec.ts_us;
+
+		streams[rec.dir].add(&rec);
+		bytes[rec.dir] += rec.length;
+	}
+
+	/* Run both directions through the parser in capture order */
+	UartComms parsers[2];
+	uint64_t frames[2] = { 0, 0 };
+	uint64_t errors[2] = { 0, 0 };
+	uint64_t start_us = monotonic_us();
+
+	for (uint32_t dir = 0; dir < 2; dir++) {
+		streams[dir].start(first_us, start_us, realtime);
+		parsers[dir].begin(streams[dir]);
+		if (!realtime) {
+			// Everything is already there, only a truncated frame can time out
+			parsers[dir].setReceiveTimout(1);
+		}
+	}
+
+	while (true) {
+		uint32_t dir = (streams[CAPTURE_TX].next() < streams[CAPTURE_RX].next()) ? CAPTURE_TX : CAPTURE_RX;
+		if (streams[dir].next() == UINT64_MAX) {
+			break;
+		}
+
+		if (realtime && !streams[dir].available()) {
+			streams[dir].wait(GAP_MS);
+			continue;
+		}
+
+		int32_t report = parsers[dir].getData();
+		double ts = (streams[dir].timestamp() - first_us) / 1e6;
+		const char *name = (dir == CAPTURE_TX) ? "TX" : "RX";
+
+		if (report == 1) {
+			frames[dir]++;
+			if (!quiet) {
+				// Message header: type and payload length
+				printf("[%12.6f] %s type %u length %u\n", ts, name,
+				       parsers[dir].incomingArray[0], parsers[dir].incomingArray[1]);
+			}
+		} else if (report != NO_DATA) {
+			errors[dir]++;
+			if (!quiet) {
+				printf("[%12.6f] %s error: %s\n", ts, name, error_name(report));
+			}
+		}
+	}
+
+	uint64_t elapsed = monotonic_us() - start_us;
+
+	printf("Sessions: %u, gaps over %u ms: %u\n", sessions, gap_ms, gaps);
+	printf("RX: %llu bytes, %llu frames, %llu errors\n",
+	       (unsigned long long)bytes[CAPTURE_RX], (unsigned long long)frames[CAPTURE_RX],
+	       (unsigned long long)errors[CAPTURE_RX]);
+	printf("TX: %llu bytes, %llu frames, %llu errors\n",
+	       (unsigned long long)bytes[CAPTURE_TX], (unsigned long long)frames[CAPTURE_TX],
+	       (unsigned long long)errors[CAPTURE_TX]);
+	if (!realtime && (elapsed > 0)) {
+		printf("Parser: %llu us, %.1f MB/s, %.0f frames/s\n", (unsigned long long)elapsed,
+		       (bytes[0] + bytes[1]) / (double)elapsed,
+		       (frames[0] + frames[1]) * 1e6 / elapsed);
+	}
+
+	return 0;
+}
@@ -0,0 +1,196 @@
+#include <fcntl.h>      // File control definitions
+#include <unistd.h>     // UNIX standard function definitions
+#include <string.h>     // string function definitions
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iostream>
+#include "sample_ring.h"
+
+//marks start on their own cache line after the header
+#define SAMPLE_RING_MARKS  64
+
+static size_t ring_size(uint32_t capacity, uint16_t batch)
+{
+	return SAMPLE_RING_MARKS + (size_t)(capacity / batch) * sizeof(uint64_t) + capacity;
+}
+
+SampleRing::~SampleRing()
+{
+	if (header != NULL) {
+		munmap(header, size);
+	}
+}
+
+int32_t SampleRing::create(const char *filename, uint8_t inputs, uint16_t batch, uint32_t rate)
+{
+	static_assert(sizeof(struct sample_ring_header) <= SAMPLE_RING_MARKS, "ring header too large");
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock free");
+
+	if ((batch == 0) || (rate == 0)) {
+		return -1;
+	}
+	uint32_t capacity = SAMPLE_RING_CAPACITY / batch * batch;
+	size = ring_size(capacity, batch);
+
+	// Readers of a previous stream keep their mapping of the old file
+	unlink(filename);
+	int fd = ::open(filename, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		std::cerr << "Sample file " << filename << " cannot be created." << std::endl;
+		return -1;
+	}
+	if (ftruncate(fd, size) < 0) {
+		std::cerr << "Sample file " << filename << " cannot be sized." << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return -1;
+	}
+
+	header = (struct sample_ring_header *)addr;
+	marks = (uint64_t *)((uint8_t *)addr + SAMPLE_RING_MARKS);
+	samples = (uint8_t *)(marks + capacity / batch);
+
+	header->version = SAMPLE_RING_VERSION;
+	header->inputs = inputs;
+	header->batch = batch;
+	header->rate = rate;
+	header->capacity = capacity;
+	header->head.store(0, std::memory_order_relaxed);
+	header->lost.store(0, std::memory_order_relaxed);
+	// Readers check the magic last
+	std::atomic_thread_fence(std::memory_order_release);
+	memcpy(header->magic, SAMPLE_RING_MAGIC, 4);
+
+	return 0;
+}
+
+const struct sample_ring_header *SampleRing::info(void) const
+{
+	return header;
+}
+
+void SampleRing::append(const uint8_t *data, uint64_t host_us)
+{
+	uint64_t head = header->head.load(std::memory_order_relaxed);
+	uint32_t batch = header->batch;
+
+	// The head published last announces which slots get overwritten next
+	std::atomic_thread_fence(std::memory_order_release);
+
+	marks[(head / batch) % (header->capacity / batch)] = host_us;
+	memcpy(&samples[head % header->capacity], data, batch);
+
+	header->head.store(head + batch, std::memory_order_release);
+}
+
+void SampleRing::skip(uint32_t batches, uint64_t host_us)
+{
+	uint8_t lost[UINT16_MAX + 1];
+	uint32_t batch = header->batch;
+	uint64_t period_us = (uint64_t)batch * 1000000 / header->rate;
+
+	// Only the last capacity worth of samples is visible anyway
+	if (batches > header->capacity / batch) {
+		batches = header->capacity / batch;
+	}
+
+	memset(lost, SAMPLE_LOST, batch);
+	for (uint32_t i = batches; i > 0; i--) {
+		append(lost, host_us - i * period_us);
+	}
+	header->lost.fetch_add((uint64_t)batches * batch, std::memory_order_relaxed);
+}
+
+SampleReader::~SampleReader()
+{
+	if (header != NULL) {
+		munmap((void *)header, size);
+	}
+}
+
+int32_t SampleReader::open(const char *filename)
+{
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0) {
+		std::cerr << "Sample file " << filename << " cannot be opened." << std::endl;
+		return -1;
+	}
+
+	struct stat st;
+	if ((fstat(fd, &st) < 0) || (st.st_size < SAMPLE_RING_MARKS)) {
+		std::cerr << "Sample file " << filename << " is not a sample ring." << std::endl;
+		close(fd);
+		return -1;
+	}
+
+	void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return -1;
+	}
+	header = (const struct sample_ring_header *)addr;
+	size = st.st_size;
+
+	if ((memcmp(header->magic, SAMPLE_RING_MAGIC, 4) != 0) || (header->version != SAMPLE_RING_VERSION) ||
+	    (header->batch == 0) || (header->rate == 0) ||
+	    (ring_size(header->capacity, header->batch) != size)) {
+		std::cerr << "Sample file " << filename << " is not a sample ring." << std::endl;
+		munmap(addr, size);
+		header = NULL;
+		return -1;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	marks = (const uint64_t *)((const uint8_t *)addr + SAMPLE_RING_MARKS);
+	samples = (const uint8_t *)(marks + header->capacity / header->batch);
+
+	return 0;
+}
+
+const struct sample_ring_header *SampleReader::info(void) const
+{
+	return header;
+}
+
+uint64_t SampleReader::head(void) const
+{
+	return header->head.load(std::memory_order_acquire);
+}
+
+uint64_t SampleReader::tail(void) const
+{
+	// The batch after the head may be half overwritten already
+	uint64_t h = head();
+	uint64_t keep = header->capacity - header->batch;
+	return (h > keep) ? (h - keep) : 0;
+}
+
+const uint8_t *SampleReader::peek(uint64_t pos, uint32_t *count) const
+{
+	uint64_t h = head();
+	uint32_t offset = pos % header->capacity;
+
+	*count = 0;
+	if (pos < h) {
+		uint64_t avail = h - pos;
+		*count = (avail < header->capacity - offset) ? avail : (header->capacity - offset);
+	}
+	return &samples[offset];
+}
+
+bool SampleReader::intact(uint64_t pos) const
+{
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return pos >= tail();
+}
+
+uint64_t SampleReader::timestamp(uint64_t pos) const
+{
+	uint32_t batch = header->batch;
+	return marks[(pos / batch) % (header->capacity / batch)] + (pos % batch) * 1000000 / header->rate;
+}
@@ -0,0 +1,255 @@
+#include <fcntl.h>      // File control definitions
+#include <unistd.h>     // UNIX standard function definitions
+#include <string.h>     // string function definitions
+#include <limits.h>
+#include <stdlib.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <iostream>
+#include "shm_state.h"
+
+uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+	#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+	#endif
+}
+
+SharedState::~SharedState()
+{
+	if (region != NULL) {
+		munmap(region, sizeof(struct shm_region));
+	}
+}
+
+int32_t SharedState::open(const char *port)
+{
+	static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock free");
+
+	// Several names can point to the same device
+	char path[PATH_MAX];
+	if (realpath(port, path) == NULL) {
+		snprintf(path, sizeof(path), "%s", port);
+	}
+	// A truncated name could match another port
+	if (strlen(path) >= SHM_PORT_LEN) {
+		std::cerr << "Port name " << path << " is too long for shared memory." << std::endl;
+		return -1;
+	}
+
+	int fd = shm_open(SHM_NAME, O_RDWR | O_CREAT, 0666);
+	if (fd < 0) {
+		std::cerr << "Shared memory " << SHM_NAME << " cannot be opened." << std::endl;
+		return -1;
+	}
+
+	// Growing a new segment zero fills it: every slot is free.
+	// On an existing one this is a no-op, so there is no creation race.
+	if (ftruncate(fd, sizeof(struct shm_region)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	void *addr = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	region = (struct shm_region *)addr;
+
+	// Looking for the port and claiming a slot for it is one step: two
+	// processes that both found no slot would otherwise claim one each.
+	// The lock goes with the descriptor, also if the process dies.
+	if (flock(fd, LOCK_EX) < 0) {
+		close(fd);
+		munmap(region, sizeof(struct shm_region));
+		region = NULL;
+		return -1;
+	}
+	int32_t ret = claim(path);
+	close(fd);
+	return ret;
+}
+
+int32_t SharedState::claim(const char *path)
+{
+	if (region->magic.load(std::memory_order_acquire) != SHM_MAGIC) {
+		region->version = SHM_VERSION;
+		region->magic.store(SHM_MAGIC, std::memory_order_release);
+	} else if (region->version != SHM_VERSION) {
+		std::cerr << "Shared memory " << SHM_NAME << " has an unknown version." << std::endl;
+		munmap(region, sizeof(struct shm_region));
+		region = NULL;
+		return -1;
+	}
+
+	// Existing slot for this port
+	for (uint32_t i = 0; i < SHM_MAX_BOARDS; i++) {
+		struct shm_board *b = &region->boards[i];
+		if ((b->state.load(std::memory_order_acquire) == SLOT_READY) &&
+		    (strncmp(b->port, path, SHM_PORT_LEN) == 0)) {
+			board = b;
+			return 0;
+		}
+	}
+
+	// Claim a free one
+	for (uint32_t i = 0; i < SHM_MAX_BOARDS; i++) {
+		struct shm_board *b = &region->boards[i];
+		uint32_t expected = SLOT_FREE;
+		if (b->state.compare_exchange_strong(expected, SLOT_CLAIMED, std::memory_order_acquire)) {
+			memcpy(b->port, path, strlen(path) + 1);
+			b->state.store(SLOT_READY, std::memory_order_release);
+			board = b;
+			return 0;
+		}
+	}
+
+	std::cerr << "Shared memory " << SHM_NAME << " is full." << std::endl;
+	return -1;
+}
+
+void SharedState::beginWrite(void)
+{
+	// Writers from other processes take turns on the odd count
+	uint32_t seq = board->seq.load(std::memory_order_relaxed);
+	uint32_t spins = 0;
+	uint64_t start = 0;
+	while (true) {
+		if (!(seq & 1)) {
+			if (board->seq.compare_exchange_weak(seq, seq + 1, std::memory_order_relaxed)) {
+				board->writer.store(getpid(), std::memory_order_relaxed);
+				break;
+			}
+			continue;
+		}
+
+		// An update is a few stores, a long wait means the writer is gone
+		if (++spins < SHM_RETRIES) {
+			cpu_relax();
+		} else {
+			uint64_t now = monotonic_ns();
+			if (start == 0) {
+				start = now;
+			}
+			if (takeOver(now - start)) {
+				break;
+			}
+			sched_yield();
+		}
+		seq = board->seq.load(std::memory_order_relaxed);
+	}
+	std::atomic_thread_fence(std::memory_order_release);
+}
+
+bool SharedState::takeOver(uint64_t waited_ns)
+{
+	int32_t pid = board->writer.load(std::memory_order_relaxed);
+	bool dead = (pid != 0) && (kill(pid, 0) < 0) && (errno == ESRCH);
+	if (!dead && (waited_ns < SHM_STUCK_NS)) {
+		return false;
+	}
+
+	// The odd count is kept, only one waiting writer gets it
+	if (!board->writer.compare_exchange_strong(pid, getpid(), std::memory_order_acquire)) {
+		return false;
+	}
+	if (!(board->seq.load(std::memory_order_relaxed) & 1)) {
+		// Finished meanwhile after all
+		board->writer.store(0, std::memory_order_relaxed);
+		return false;
+	}
+
+	// Whatever it left half written is stale
+	board->updated_ns.store(0, std::memory_order_relaxed);
+	return true;
+}
+
+void SharedState::endWrite(void)
+{
+	// A writer that was taken over leaves the count to the one that took it
+	int32_t self = getpid();
+	if (board->writer.compare_exchange_strong(self, 0, std::memory_order_relaxed)) {
+		board->seq.fetch_add(1, std::memory_order_release);
+	}
+}
+
+void SharedState::publish(const RelayMask &do_mask, uint8_t channels)
+{
+	if (board == NULL) {
+		return;
+	}
+
+	beginWrite();
+	for (uint32_t i = 0; i < SHM_MASK_BYTES; i++) {
+		board->do_mask[i].store(do_mask.raw()[i], std::memory_order_relaxed);
+	}
+	board->channels.store(channels, std::memory_order_relaxed);
+	board->link_up.store(1, std::memory_order_relaxed);
+	board->updated_ns.store(monotonic_ns(), std::memory_order_relaxed);
+	endWrite();
+}
+
+void SharedState::setLink(bool link_up)
+{
+	if (board == NULL) {
+		return;
+	}
+
+	beginWrite();
+	board->link_up.store(link_up, std::memory_order_relaxed);
+	endWrite();
+}
+
+void SharedState::invalidate(void)
+{
+	if (board == NULL) {
+		return;
+	}
+
+	beginWrite();
+	board->updated_ns.store(0, std::memory_order_relaxed);
+	endWrite();
+}
+
+bool SharedState::read(struct relay_snapshot *snap) const
+{
+	if (board == NULL) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < SHM_RETRIES; i++) {
+		uint32_t seq = board->seq.load(std::memory_order_acquire);
+		if (seq & 1) {
+			cpu_relax();
+			continue;
+		}
+
+		uint8_t do_mask[SHM_MASK_BYTES];
+		for (uint32_t b = 0; b < SHM_MASK_BYTES; b++) {
+			do_mask[b] = board->do_mask[b].load(std::memory_order_relaxed);
+		}
+		snap->do_mask.load(do_mask, SHM_MASK_BYTES);
+		snap->channels = board->channels.load(std::memory_order_relaxed);
+		snap->link_up = board->link_up.load(std::memory_order_relaxed);
+		snap->updated_ns = board->updated_ns.load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (board->seq.load(std::memory_order_relaxed) == seq) {
+			return snap->updated_ns != 0;
+		}
+	}
+
+	return false;
+}
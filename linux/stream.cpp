@@ -1,12 +1,17 @@
 #include <fcntl.h>      // File control definitions
 #include <errno.h>      // Error number definitions
 #include <sys/ioctl.h>
+#include <poll.h>
+#include <linux/serial.h>
 #include <iostream>
 #include "stream.h"
 
 //initialize the UartComms class
 int32_t Stream::begin(const char *filename, uint32_t baudrate)
 {
+	_filename = filename;
+	_baudrate = baudrate;
+
 	// Open port
 	_serial_fd = open(filename, O_RDWR | O_NOCTTY | O_NONBLOCK);//| O_NDELAY | O_SYNC);
 	if (_serial_fd == -1){
@@ -49,12 +54,66 @@ int32_t Stream::begin(const char *filename, uint32_t baudrate)
 		return -1;
 	}
 
+	_connected = true;
 	return 0;
 }
 
+int32_t Stream::reopen(void)
+{
+	close();
+	std::string filename = _filename;
+	return begin(filename.c_str(), _baudrate);
+}
+
+void Stream::close(void)
+{
+	if (_serial_fd >= 0) {
+		::close(_serial_fd);
+	}
+	_serial_fd = -1;
+	_connected = false;
+}
+
+bool Stream::connected(void) const
+{
+	return _connected;
+}
+
+void Stream::linkError(const char *what)
+{
+	if (_connected) {
+		std::cerr << "Device " << _filename << " lost (" << what << ": " << strerror(errno) << ")" << std::endl;
+	}
+	_connected = false;
+}
+
+void Stream::setCapture(Capture *capture)
+{
+	_capture = capture;
+}
+
 void Stream::write(uint8_t *buffer, uint32_t length)
 {
-	::write(_serial_fd, buffer, length);
+	uint32_t sent = 0;
+
+	// The port is nonblocking, wait for room when the driver buffer is full
+	while (_connected && (sent < length)) {
+		ssize_t n = ::write(_serial_fd, &buffer[sent], length - sent);
+		if (n > 0) {
+			sent += n;
+		} else if ((n < 0) && ((errno == EAGAIN) || (errno == EINTR))) {
+			struct pollfd pfd = { _serial_fd, POLLOUT, 0 };
+			if (poll(&pfd, 1, WRITE_TIMEOUT_MS) <= 0) {
+				linkError("write timeout");
+			}
+		} else {
+			linkError("write");
+		}
+	}
+	// Only what reached the driver, a write cut short by a link error is partial
+	if (_capture && (sent > 0)) {
+		_capture->record(CAPTURE_TX, buffer, sent);
+	}
 }
 
 void Stream::write(uint8_t val)
@@ -71,17 +130,59 @@ int32_t Stream::read(void)
 {
 	uint8_t value;
 
-	if (::read(_serial_fd, &value, 1) < 0) {
+	ssize_t n = ::read(_serial_fd, &value, 1);
+	if (n < 0) {
+		if ((errno != EAGAIN) && (errno != EINTR)) {
+			linkError("read");
+		}
+		return -1;
+	}
+	if (n == 0) {
+		// End of file on a tty: the device hung up
+		linkError("hangup");
 		return -1;
 	}
+	if (_capture) {
+		_capture->record(CAPTURE_RX, &value, 1);
+	}
 
 	return (int32_t)value;
 }
 
+bool Stream::wait(uint32_t timeout_ms)
+{
+	struct pollfd pfd;
+	pfd.fd = _serial_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	idle();
+
+	if (poll(&pfd, 1, timeout_ms) <= 0) {
+		return false;
+	}
+	if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+		linkError("hangup");
+		return false;
+	}
+	return true;
+}
+
+void Stream::idle(void)
+{
+	// The record being merged is complete
+	if (_capture) {
+		_capture->flush();
+	}
+}
+
 uint32_t Stream::available(void)
 {
-	uint32_t bytes_avail;
-	ioctl(_serial_fd, FIONREAD, &bytes_avail);
+	int bytes_avail = 0;
+	if (ioctl(_serial_fd, FIONREAD, &bytes_avail) < 0) {
+		linkError("ioctl");
+		return 0;
+	}
 
 	return bytes_avail;
 }
@@ -94,3 +195,37 @@ int32_t Stream::flush(void)
 	}
 	return 0;
 }
+
+int32_t Stream::setLowLatency(void)
+{
+	struct serial_struct serinfo;
+
+	if (ioctl(_serial_fd, TIOCGSERIAL, &serinfo) < 0) {
+		std::cerr << "Low latency mode not supported by the driver" << std::endl;
+		return -1;
+	}
+	serinfo.flags |= ASYNC_LOW_LATENCY;
+	if (ioctl(_serial_fd, TIOCSSERIAL, &serinfo) < 0) {
+		std::cerr << "Low latency mode cannot be set" << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+int32_t Stream::fd(void) const
+{
+	return _serial_fd;
+}
+
+uint32_t Stream::baudrate(void) const
+{
+	return _baudrate;
+}
+
+int32_t Stream::drain(void)
+{
+	if (_serial_fd < 0) {
+		return -1;
+	}
+	return tcdrain(_serial_fd);
+}
@@ -0,0 +1,142 @@
+#include <time.h>
+#include "timesync.h"
+
+uint64_t monotonic_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint64_t TimeSync::unwrap(uint32_t device_us)
+{
+	if (!have_device) {
+		have_device = true;
+		last_device = device_us;
+		return last_device;
+	}
+
+	//micros() wraps every ~71 minutes, move relative to the last value seen
+	int32_t diff = (int32_t)(device_us - (uint32_t)last_device);
+	uint64_t value = last_device + diff;
+	if (diff > 0) {
+		last_device = value;
+	}
+	return value;
+}
+
+void TimeSync::addSample(uint64_t t1, uint32_t t2, uint32_t t3, uint64_t t4)
+{
+	uint64_t d2 = unwrap(t2);
+	uint64_t d3 = unwrap(t3);
+
+	struct sample *s = &samples[next_sample];
+	s->host = t1 + (t4 - t1) / 2;
+	s->offset = (((double)d2 - (double)t1) + ((double)d3 - (double)t4)) / 2;
+	s->delay = (int64_t)(t4 - t1) - (int64_t)(d3 - d2);
+
+	next_sample = (next_sample + 1) % SYNC_SAMPLES;
+	if (n_samples < SYNC_SAMPLES) {
+		n_samples++;
+	}
+
+	fit();
+
+	//one-way latencies against the fitted model
+	delay = s->delay;
+	uplink = (int64_t)((double)d2 - offset(t1) - (double)t1);
+	downlink = (int64_t)((double)t4 - ((double)d3 - offset(t4)));
+	if (uplink < min_uplink) {
+		min_uplink = uplink;
+	}
+	if (downlink < min_downlink) {
+		min_downlink = downlink;
+	}
+}
+
+void TimeSync::fit(void)
+{
+	//queueing only ever adds delay, so trust the fastest exchanges most
+	int64_t min_delay = INT64_MAX;
+	for (uint32_t i = 0; i < n_samples; i++) {
+		if (samples[i].delay < min_delay) {
+			min_delay = samples[i].delay;
+		}
+	}
+
+	ref = samples[(next_sample + SYNC_SAMPLES - 1) % SYNC_SAMPLES].host;
+
+	//over a short span jitter dominates the slope, fit the offset only
+	uint64_t oldest = samples[(n_samples < SYNC_SAMPLES) ? 0 : next_sample].host;
+	bool short_span = (ref - oldest) < SYNC_MIN_SPAN_US;
+
+	double sw = 0, sx = 0, sy = 0, sxx = 0, sxy = 0;
+	for (uint32_t i = 0; i < n_samples; i++) {
+		double excess = (double)(samples[i].delay - min_delay) / 100.0;
+		double w = 1.0 / (1.0 + excess * excess);
+		double x = (double)((int64_t)(samples[i].host - ref));
+		double y = samples[i].offset;
+		sw += w;
+		sx += w * x;
+		sy += w * y;
+		sxx += w * x * x;
+		sxy += w * x * y;
+	}
+
+	double den = sw * sxx - sx * sx;
+	if ((n_samples < 2) || short_span || (den <= 0)) {
+		slope = 0;
+		base = sy / sw;
+		return;
+	}
+	slope = (sw * sxy - sx * sy) / den;
+	base = (sy - slope * sx) / sw;
+}
+
+bool TimeSync::valid(void) const
+{
+	return n_samples > 0;
+}
+
+double TimeSync::offset(uint64_t host_us) const
+{
+	return base + slope * (double)((int64_t)(host_us - ref));
+}
+
+uint64_t TimeSync::toHost(uint32_t device_us)
+{
+	//device = host + offset(host), solved for host
+	double device = (double)unwrap(device_us);
+	double rel = (device - (double)ref - base) / (1.0 + slope);
+	return ref + (int64_t)rel;
+}
+
+double TimeSync::drift(void) const
+{
+	return slope * 1e6;
+}
+
+int64_t TimeSync::lastDelay(void) const
+{
+	return delay;
+}
+
+int64_t TimeSync::lastUplink(void) const
+{
+	return uplink;
+}
+
+int64_t TimeSync::lastDownlink(void) const
+{
+	return downlink;
+}
+
+int64_t TimeSync::minUplink(void) const
+{
+	return min_uplink;
+}
+
+int64_t TimeSync::minDownlink(void) const
+{
+	return min_downlink;
+}
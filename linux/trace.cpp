@@ -0,0 +1,132 @@
+#include <time.h>
+#include <iostream>
+#include "trace.h"
+
+#define TRACE_PID_HOST    1
+#define TRACE_PID_DEVICE  2
+
+//name of the span ending at each stage
+static const char *stage_names[TRACE_STAGES] = {
+	"build",
+	"encode",
+	"write",
+	"drain",
+	"wait answer",
+	"receive",
+	"dispatch",
+	"first byte",
+	"receive",
+	"dispatch"
+};
+
+Trace::~Trace()
+{
+	if (file != NULL) {
+		flush();
+		fprintf(file, "\n]\n");
+		fclose(file);
+	}
+}
+
+int32_t Trace::open(const char *filename)
+{
+	file = fopen(filename, "w");
+	if (file == NULL) {
+		std::cerr << "Trace file " << filename << " cannot be opened." << std::endl;
+		return -1;
+	}
+
+	fprintf(file, "[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"host\"}},\n", TRACE_PID_HOST);
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"firmware\"}}", TRACE_PID_DEVICE);
+	events = 2;
+
+	return 0;
+}
+
+uint64_t Trace::now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void Trace::begin(const char *frame_name)
+{
+	if (file == NULL) {
+		return;
+	}
+
+	// Written out between frames, off the measured path
+	flush();
+	name = frame_name;
+	record(TRACE_BUILT, now_ns());
+}
+
+void Trace::record(uint8_t stage, uint64_t ns)
+{
+	if (count < TRACE_MAX_MARKS) {
+		marks[count].ns = ns;
+		marks[count].stage = stage;
+		count++;
+	}
+}
+
+void Trace::flush(void)
+{
+	if ((file == NULL) || (count == 0)) {
+		return;
+	}
+
+	uint64_t first = 0;
+	uint64_t last = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		if (marks[i].stage >= TRACE_DEV_RX_FIRST) {
+			continue;
+		}
+		if ((first == 0) || (marks[i].ns < first)) {
+			first = marks[i].ns;
+		}
+		if (marks[i].ns > last) {
+			last = marks[i].ns;
+		}
+	}
+
+	// The whole frame on the host, stages nest inside it
+	frames++;
+	event((name != NULL) ? name : "unsolicited", TRACE_PID_HOST, first, last);
+
+	// Each span ends at a stage and starts at the previous one of its side
+	uint64_t prev_host = 0;
+	uint64_t prev_device = 0;
+	for (uint32_t i = 0; i < count; i++) {
+		uint8_t stage = marks[i].stage;
+		if (stage < TRACE_DEV_RX_FIRST) {
+			if ((prev_host != 0) && (stage != TRACE_BUILT)) {
+				event(stage_names[stage], TRACE_PID_HOST, prev_host, marks[i].ns);
+			}
+			prev_host = marks[i].ns;
+		} else {
+			if ((prev_device != 0) && (stage != TRACE_DEV_RX_FIRST)) {
+				event(stage_names[stage], TRACE_PID_DEVICE, prev_device, marks[i].ns);
+			}
+			prev_device = marks[i].ns;
+		}
+	}
+
+	count = 0;
+	name = NULL;
+	fflush(file);
+}
+
+void Trace::event(const char *event_name, uint32_t pid, uint64_t start_ns, uint64_t end_ns)
+{
+	uint64_t dur_ns = (end_ns > start_ns) ? (end_ns - start_ns) : 0;
+
+	// Chrome trace times are in microseconds
+	fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":1,\"ts\":%llu.%03u,\"dur\":%llu.%03u,\"args\":{\"frame\":%u}}",
+	        (events > 0) ? ",\n" : "", event_name, pid,
+	        (unsigned long long)(start_ns / 1000), (uint32_t)(start_ns % 1000),
+	        (unsigned long long)(dur_ns / 1000), (uint32_t)(dur_ns % 1000), frames);
+	events++;
+}
@@ -2,7 +2,22 @@
 #include "uart.h"
 #include <string.h>     // string function definitions
 #include <unistd.h>     // UNIX standard function definitions
-#include <ctime>
+#include <time.h>
+
+//pollData() parser states
+#define RX_START     0
+#define RX_LENGTH    1
+#define RX_PAYLOAD   2
+#define RX_CHECKSUM  3
+#define RX_END       4
+
+//monotonic milliseconds, for the receive timeouts
+static uint32_t millis(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
 
 //initialize the UartComms class
 void UartComms::begin(Stream &stream)
@@ -10,7 +25,13 @@ void UartComms::begin(Stream &stream)
 	_serial = &stream;
 }
 
-//change the UART buffer timeout (10ms by default)
+//record the lifecycle stages of every frame
+void UartComms::setTrace(Trace *trace)
+{
+	_trace = trace;
+}
+
+//change the UART buffer timeout (1000ms by default)
 void UartComms::setReceiveTimout(uint8_t _timeout)
 {
 	timeout = _timeout;
@@ -34,18 +55,20 @@ uint8_t UartComms::calculateChecksum(uint8_t len, uint8_t *buff)
 	return crc;
 }
 
-//send a selection of data from outgoingArray
-bool UartComms::sendData(uint8_t data_len)
+//encode a selection of data from outgoingArray into a complete dataframe
+uint32_t UartComms::encode(uint8_t data_len, uint8_t *frame, bool packed)
 {
 	// Length higher than expected
 	if (data_len > DATA_LEN) {
-		return false;
+		return 0;
 	}
 
-	uint8_t buff_len = data_len * 2;
-	uint8_t auxBuff[BUFF_LEN];
+	uint8_t buff_len = packed ? data_len : (data_len * 2);
+	uint8_t *auxBuff = &frame[2];
 	// Update auxiliar buffer
-	{
+	if (packed) {
+		memcpy(&auxBuff[0], &outgoingArray[0], data_len);
+	} else {
 		uint8_t j = 0;
 		for (uint8_t i = 0; i < data_len; i++) {
 			auxBuff[j++] = i; // message ID
@@ -53,23 +76,39 @@ bool UartComms::sendData(uint8_t data_len)
 		}
 	}
 
-	//update checksum before sending dataframe
-	uint8_t checksum = calculateChecksum(buff_len, &auxBuff[0]);
+	//START_BYTE and payload data_len in bytes
+	frame[0] = START_BYTE;
+	frame[1] = packed ? (buff_len | PACKED_FLAG) : buff_len;
 
-	//send START_BYTE
-	_serial->write(START_BYTE);
+	//checksum and END_BYTE
+	frame[buff_len + 2] = calculateChecksum(buff_len, &auxBuff[0]);
+	frame[buff_len + 3] = END_BYTE;
 
-	//send payload data_len in bytes
-	_serial->write(buff_len);
+	if (_trace) {
+		_trace->mark(TRACE_ENCODED);
+	}
 
-	//send payload
-	_serial->write(&auxBuff[0], buff_len);
+	return buff_len + 4;
+}
 
-	//send checksum
-	_serial->write(checksum);
+//send a selection of data from outgoingArray
+bool UartComms::sendData(uint8_t data_len, bool packed)
+{
+	uint8_t frame[FRAME_LEN];
+	uint32_t frame_len = encode(data_len, frame, packed);
+	if (frame_len == 0) {
+		return false;
+	}
 
-	//send END_BYTE
-	_serial->write(END_BYTE);
+	//send the whole dataframe at once
+	_serial->write(&frame[0], frame_len);
+
+	//waiting for the wire is only worth it to see how long it takes
+	if (_trace) {
+		_trace->mark(TRACE_WRITTEN);
+		_serial->drain();
+		_trace->mark(TRACE_DRAINED);
+	}
 
 	return true;
 }
@@ -77,17 +116,22 @@ bool UartComms::sendData(uint8_t data_len)
 //update incomingArray with new data if available
 int8_t UartComms::getData()
 {
-	std::time_t startTime = 0;
-	std::time_t endTime = 0;
+	uint32_t startTime = 0;
+	uint32_t endTime = 0;
 
 	uint8_t payloadLen = 0;
 
 	bool startFound = false;
 
+	//the device is gone, nothing will ever arrive
+	if (!_serial->connected()) {
+		return LINK_ERROR;
+	}
+
 	//see if any data is in the serial buffer
 	if (_serial->available()) {
-		startTime = std::time(0);
-		endTime = std::time(0);
+		startTime = millis();
+		endTime = millis();
 
 		//process only what bytes are currently in the buffer when looking for the START_BYTE
 		while (_serial->available()) {
@@ -101,7 +145,7 @@ int8_t UartComms::getData()
 			}
 
 			//update timer
-			endTime = std::time(0);
+			endTime = millis();
 
 			//test for timeout
 			if ((endTime - startTime) >= timeout) {
@@ -112,57 +156,79 @@ int8_t UartComms::getData()
 
 		//determine if the start of frame byte was found
 		if (startFound) {
-			//wait for the payload byte
-			while (_serial->available() == 0);
+			if (_trace) {
+				_trace->mark(TRACE_RX_FIRST);
+			}
+
+			//prime the timeout timer, the whole dataframe must arrive within the timeout
+			startTime = millis();
 
 			//read in the number of bytes in the payload of the packet
-			payloadLen = _serial->read();
+			int16_t value = readByte(startTime);
+			if (value < 0) {
+				return TIMEOUT_ERROR;
+			}
+			payloadLen = value;
+
+			//packed frames carry the raw data bytes in order, without message IDs
+			bool packed = (payloadLen & PACKED_FLAG) != 0;
+			if (packed) {
+				payloadLen &= ~PACKED_FLAG;
+				if (payloadLen > DATA_LEN) {
+					return PAYLOAD_ERROR;
+				}
+			}
 
 			//sanity check for the payload length (should be a multiple of 2 - 1 byte for ID, 1 for raw data)
-			if ((payloadLen > (DATA_LEN * 2)) || (payloadLen % 2)) {
+			if (!packed && ((payloadLen > (DATA_LEN * 2)) || (payloadLen % 2))) {
 				//oops, bad payload length value
 				return PAYLOAD_ERROR;
 			}
 
-			//prime the timeout timer
-			startTime = std::time(0);
-			endTime = std::time(0);
-
-			//wait for rest of dataframe to arrive with timeout
-			while (_serial->available() < (payloadLen + 2)) {  //add 2 (1 for checksum and 1 for END_BYTE)
-				//update timer
-				endTime = std::time(0);
-
-				//test for timeout
-				if ((endTime - startTime) >= timeout) {
+			uint8_t auxBuff[BUFF_LEN];
+			//stuff payload bytes in the buffer as they arrive - a full dataframe does not fit in the serial RX buffer
+			for (uint8_t i = 0; i < payloadLen; i++) {
+				value = readByte(startTime);
+				if (value < 0) {
 					//oops, data didn't arrive on time - better get back to processing other things
 					return TIMEOUT_ERROR;
 				}
-			}
-
-			uint8_t auxBuff[BUFF_LEN];
-			//stuff all payload bytes in the buffer for processing
-			for (uint8_t i = 0; i < payloadLen; i++) {
-				auxBuff[i] = _serial->read();
+				auxBuff[i] = value;
 			}
 
 			//update checksum before processing
 			uint8_t checksum = calculateChecksum(payloadLen, &auxBuff[0]);
 
 			//test received checksum
-			if (_serial->read() != checksum) {
+			value = readByte(startTime);
+			if (value < 0) {
+				return TIMEOUT_ERROR;
+			}
+			if (value != checksum) {
 				//dang, checksums don't match - can't trust the data - get back to the main code
 				return CHECKSUM_ERROR;
 			}
 
 			//test END_BYTE
-			if (_serial->read() != END_BYTE) {
+			value = readByte(startTime);
+			if (value < 0) {
+				return TIMEOUT_ERROR;
+			}
+			if (value != END_BYTE) {
 				//ugh, END_BYTE wasn't found in the right spot - can't trust the data - get back to the main code
 				return END_BYTE_ERROR;
 			}
 
+			if (_trace) {
+				_trace->mark(TRACE_RX_CHECKED);
+			}
+
 			//process raw data and stuff into dataArray only if all data validity tests are passed
-			processData(payloadLen, &auxBuff[0]);
+			if (packed) {
+				memcpy(&incomingArray[0], &auxBuff[0], payloadLen);
+			} else {
+				processData(payloadLen, &auxBuff[0]);
+			}
 
 			//nocie, everything checked out
 			return 1;
@@ -176,12 +242,121 @@ int8_t UartComms::getData()
 	return NO_DATA;
 }
 
+//consume the bytes already received without waiting
+int8_t UartComms::pollData()
+{
+	//the device is gone, nothing will ever arrive
+	if (!_serial->connected()) {
+		return LINK_ERROR;
+	}
+
+	while (_serial->available()) {
+		int8_t report = feedByte(_serial->read());
+		if (report != NO_DATA) {
+			return report;
+		}
+	}
+
+	//a dataframe that stopped arriving is dropped, the next START_BYTE begins a new one
+	if ((rxState != RX_START) && ((millis() - rxStart) >= frameTime())) {
+		rxState = RX_START;
+		return TIMEOUT_ERROR;
+	}
+
+	return NO_DATA;
+}
+
+//advance the pollData() parser by one byte, NO_DATA until a dataframe ends
+int8_t UartComms::feedByte(uint8_t value)
+{
+	switch (rxState) {
+	case RX_START:
+		//garbage bytes between dataframes are skipped
+		if (value == START_BYTE) {
+			if (_trace) {
+				_trace->mark(TRACE_RX_FIRST);
+			}
+			rxStart = millis();
+			rxState = RX_LENGTH;
+		}
+		return NO_DATA;
+
+	case RX_LENGTH:
+		//same sanity checks as getData()
+		rxPacked = (value & PACKED_FLAG) != 0;
+		rxLen = rxPacked ? (value & ~PACKED_FLAG) : value;
+		if (rxPacked ? (rxLen > DATA_LEN) : ((rxLen > (DATA_LEN * 2)) || (rxLen % 2))) {
+			rxState = RX_START;
+			return PAYLOAD_ERROR;
+		}
+		rxPos = 0;
+		rxState = (rxLen > 0) ? RX_PAYLOAD : RX_CHECKSUM;
+		return NO_DATA;
+
+	case RX_PAYLOAD:
+		rxBuff[rxPos++] = value;
+		if (rxPos == rxLen) {
+			rxState = RX_CHECKSUM;
+		}
+		return NO_DATA;
+
+	case RX_CHECKSUM:
+		if (value != calculateChecksum(rxLen, &rxBuff[0])) {
+			rxState = RX_START;
+			return CHECKSUM_ERROR;
+		}
+		rxState = RX_END;
+		return NO_DATA;
+
+	default:
+		rxState = RX_START;
+		if (value != END_BYTE) {
+			return END_BYTE_ERROR;
+		}
+		if (_trace) {
+			_trace->mark(TRACE_RX_CHECKED);
+		}
+		if (rxPacked) {
+			memcpy(&incomingArray[0], &rxBuff[0], rxLen);
+		} else {
+			processData(rxLen, &rxBuff[0]);
+		}
+		return 1;
+	}
+}
+
+//time a whole dataframe takes on the wire, 10 bits a byte, with 1ms to spare
+uint32_t UartComms::frameTime(void)
+{
+	uint32_t baudrate = _serial->baudrate();
+	if (baudrate == 0) {
+		return timeout;
+	}
+	return (FRAME_LEN * 10 * 1000 + baudrate - 1) / baudrate + 1;
+}
+
+//read one byte of the current dataframe, -1 if the frame timeout expires first
+int16_t UartComms::readByte(uint32_t startTime)
+{
+	while (_serial->available() == 0) {
+		if (!_serial->connected()) {
+			return -1;
+		}
+		uint32_t elapsed = millis() - startTime;
+		if (elapsed >= timeout) {
+			return -1;
+		}
+		_serial->wait(timeout - elapsed);
+	}
+	return _serial->read();
+}
+
 void UartComms::processData(uint8_t payloadLen, uint8_t *buff)
 {
 	//check if payloadLen is valid
 	for (uint8_t i = 0; i < payloadLen; i = i + 2) {
 		//sanity check for messageID
-		if (buff[i] <= DATA_LEN) {
+		if (buff[i] < DATA_LEN) {
 			incomingArray[buff[i]] = (buff[i + 1]);
 		}
 	}